@@ -7,6 +7,7 @@
 #include <boost/bind.hpp>
 #include <fc/thread/future.hpp>
 #include <fc/io/iostream.hpp>
+#include <type_traits>
 
 namespace fc { 
 /**
@@ -31,10 +32,33 @@ namespace asio {
         void error_handler_ec( promise<boost::system::error_code>* p, 
                               const boost::system::error_code& ec ); 
 
+        /** converts ec into the fc exception that the async handlers would have set */
+        NO_RETURN void throw_error( const boost::system::error_code& ec );
+
+        /**
+         *  Counts a read or write that completed without waiting.  A fiber on a
+         *  stream that always has data would otherwise never let the other
+         *  tasks on its thread run, so after sync_completion_limit of them on a
+         *  thread the next attempt yields first, see yield_if_sync_limit().
+         */
+        void sync_completed();
+        /**
+         *  Yields if sync_completion_limit reads and writes completed without
+         *  waiting since the last yield.  Called before the syscall, never
+         *  after it: a cancelled fiber would lose the bytes it had moved.
+         */
+        void yield_if_sync_limit();
+        static const uint32_t sync_completion_limit = 16;
+
         template<typename C>
         struct non_blocking { 
           bool operator()( C& c ) { return c.non_blocking(); } 
-          bool operator()( C& c, bool s ) { c.non_blocking(s); return true; } 
+          bool operator()( C& c, bool s ) 
+          { 
+             boost::system::error_code ec;
+             c.non_blocking(s,ec); 
+             return !ec; 
+          } 
         };
 
         #if WIN32  // windows stream handles do not support non blocking!
@@ -45,15 +69,179 @@ namespace asio {
             bool operator()( C&, bool ) { return false; } 
         };
         #endif 
+
+        /**
+         *  Puts s in non-blocking mode and reads synchronously.
+         *
+         *  @return false if the read would block and must be done asynchronously
+         *  @throw  on any other error
+         */
+        template<typename AsyncReadStream, typename MutableBufferSequence>
+        bool try_read_some( AsyncReadStream& s, const MutableBufferSequence& buf, size_t& r ) {
+            non_blocking<AsyncReadStream> nb;
+            if( !nb(s) && !nb(s,true) ) return false;
+            yield_if_sync_limit();
+            boost::system::error_code ec;
+            r = s.read_some( buf, ec );
+            if( ec == boost::asio::error::would_block ) return false;
+            if( ec ) throw_error( ec );
+            sync_completed();
+            return true;
+        }
+
+        /**
+         *  A promise<size_t> that can be reset and waited on again, along with a
+         *  small block of memory that asio allocates the completion handler from.
+         */
+        class reusable_op : public promise<size_t>
+        {
+           public:
+             typedef fc::shared_ptr<reusable_op> ptr;
+
+             reusable_op( const char* desc )
+             :promise<size_t>(desc),_mem_in_use(false){}
+
+             void reset()
+             {
+                result.reset();
+                _reset();
+             }
+
+             void* allocate( size_t s )
+             {
+                if( !_mem_in_use && s <= sizeof(_mem) )
+                {
+                   _mem_in_use = true;
+                   return &_mem;
+                }
+                return ::operator new(s);
+             }
+
+             void deallocate( void* p )
+             {
+                if( p == &_mem ) _mem_in_use = false;
+                else ::operator delete(p);
+             }
+
+           protected:
+             ~reusable_op(){}
+
+           private:
+             std::aligned_storage<256>::type _mem;
+             bool                            _mem_in_use;
+        };
+
+        /** completes a reusable_op and has asio allocate the handler from it */
+        struct reusable_op_handler
+        {
+           reusable_op_handler( const reusable_op::ptr& p ):op(p){}
+
+           void operator()( const boost::system::error_code& ec, size_t bytes_transferred )
+           {
+              read_write_handler( op, ec, bytes_transferred );
+           }
+
+           friend void* asio_handler_allocate( size_t s, reusable_op_handler* h ) 
+           { 
+              return h->op->allocate(s); 
+           }
+           friend void  asio_handler_deallocate( void* p, size_t, reusable_op_handler* h ) 
+           { 
+              h->op->deallocate(p); 
+           }
+
+           reusable_op::ptr op;
+        };
+
+        /** a ConstBufferSequence over an array of buffers owned by the caller */
+        struct const_buffer_range
+        {
+           typedef boost::asio::const_buffer        value_type;
+           typedef const boost::asio::const_buffer* const_iterator;
+
+           const_buffer_range( const_iterator b, const_iterator e ):_begin(b),_end(e){}
+
+           const_iterator begin()const { return _begin; }
+           const_iterator end()const   { return _end;   }
+
+           const_iterator _begin;
+           const_iterator _end;
+        };
+
+        /** @see try_read_some() */
+        template<typename AsyncWriteStream, typename ConstBufferSequence>
+        bool try_write_some( AsyncWriteStream& s, const ConstBufferSequence& buf, size_t& r ) {
+            non_blocking<AsyncWriteStream> nb;
+            if( !nb(s) && !nb(s,true) ) return false;
+            yield_if_sync_limit();
+            boost::system::error_code ec;
+            r = s.write_some( buf, ec );
+            if( ec == boost::asio::error::would_block ) return false;
+            if( ec ) throw_error( ec );
+            sync_completed();
+            return true;
+        }
     }
     /**
      * @return the default boost::asio::io_service for use with fc::asio
      * 
-     * This IO service is automatically running in its own thread to service asynchronous
-     * requests without blocking any other threads.
+     * There is a pool of reactor_count() IO services, each automatically running in its 
+     * own thread to service asynchronous requests without blocking any other threads.
+     * The first time a thread calls this method it is bound to one of the IO services,
+     * round robin, and every later call from that thread returns the same IO service. 
+     * Everything a thread creates, and therefore every completion it waits on, is 
+     * serviced by the same reactor thread.
      */
     boost::asio::io_service& default_io_service(bool cleanup = false);
 
+    /**
+     *  Gives the calling thread its own io_service that it runs from its idle
+     *  loop instead of sleeping.  default_io_service() then returns that 
+     *  io_service on this thread, and completions for everything created 
+     *  with it run inline on this thread without any cross thread handoff.
+     *
+     *  @pre default_io_service() has not been called from this thread
+     *  @pre objects created on this thread's io_service do not outlive the thread
+     */
+    void integrate_reactor();
+
+    /**
+     *  Sets the number of IO service threads, defaults to 1.
+     *
+     *  @pre default_io_service() has not been called yet
+     */
+    void     set_reactor_count( uint32_t n );
+    uint32_t reactor_count();
+
+    /**
+     *  @brief a reusable slot for one read or write at a time on a stream
+     *
+     *  Passing the same operation to every read_some()/write_some() on a stream
+     *  reuses its promise and the memory asio allocates the completion handler 
+     *  from, so that steady state io does not touch the heap.  If the previous
+     *  operation is still referenced, for instance by a handler that has not been 
+     *  destroyed yet, a new one is allocated and kept for next time.
+     */
+    class operation
+    {
+       public:
+         operation( const char* desc = "fc::asio::operation" ):_desc(desc){}
+
+         /** @return an idle op, reset and ready to be completed */
+         detail::reusable_op::ptr acquire()
+         {
+            if( !_op || _op->retain_count() != 1 ) 
+               _op.reset( new detail::reusable_op(_desc) );
+            else
+               _op->reset();
+            return _op;
+         }
+
+       private:
+         const char*               _desc;
+         detail::reusable_op::ptr  _op;
+    };
+
     /** 
      *  @brief wraps boost::asio::async_read
      *  @pre s.non_blocking() == true
@@ -81,11 +269,29 @@ namespace asio {
     template<typename AsyncReadStream, typename MutableBufferSequence>
     size_t read_some( AsyncReadStream& s, const MutableBufferSequence& buf ) 
     {
+        size_t r = 0;
+        if( detail::try_read_some( s, buf, r ) ) return r;
+
         promise<size_t>::ptr p(new promise<size_t>("fc::asio::async_read_some"));
         s.async_read_some( buf, boost::bind( detail::read_write_handler, p, _1, _2 ) );
         return p->wait();
     }
 
+    /** 
+     *  Same as read_some() but completes through op instead of allocating
+     *  a new promise and handler.
+     */
+    template<typename AsyncReadStream, typename MutableBufferSequence>
+    size_t read_some( AsyncReadStream& s, const MutableBufferSequence& buf, operation& op ) 
+    {
+        size_t r = 0;
+        if( detail::try_read_some( s, buf, r ) ) return r;
+
+        auto p = op.acquire();
+        s.async_read_some( buf, detail::reusable_op_handler(p) );
+        return p->wait();
+    }
+
     template<typename AsyncReadStream>
     size_t read_some( AsyncReadStream& s, boost::asio::streambuf& buf )
     {
@@ -105,18 +311,89 @@ namespace asio {
         return p->wait();
     }
 
+    /** @brief wraps boost::asio::async_write, completing through op */
+    template<typename AsyncWriteStream, typename ConstBufferSequence>
+    size_t write( AsyncWriteStream& s, const ConstBufferSequence& buf, operation& op ) {
+        auto p = op.acquire();
+        boost::asio::async_write(s, buf, detail::reusable_op_handler(p) );
+        return p->wait();
+    }
+
+    /** @brief wraps boost::asio::async_write over all n buffers so
+     *         that they may be sent with a single gathering write
+     *  @param op if not null, any asynchronous write completes through op
+     *  @return the number of bytes written
+     */
+    template<typename AsyncWriteStream>
+    size_t writev( AsyncWriteStream& s, const fc::const_buffer* bufs, size_t n, operation* op = nullptr ) {
+        // avoid allocating for the common case of a handful of buffers
+        boost::asio::const_buffer              small[16];
+        std::vector<boost::asio::const_buffer> large;
+        boost::asio::const_buffer*             seq = small;
+        if( n > 16 )
+        {
+           large.resize(n);
+           seq = large.data();
+        }
+
+        size_t count = 0;
+        size_t total = 0;
+        for( size_t i = 0; i < n; ++i )
+        {
+           if( bufs[i].size ) seq[count++] = boost::asio::const_buffer( bufs[i].data, bufs[i].size );
+           total += bufs[i].size;
+        }
+        if( !count ) return 0;
+
+        // usually the socket buffer has room and the whole write completes inline
+        size_t sent = 0;
+        if( !detail::try_write_some( s, detail::const_buffer_range( seq, seq + count ), sent ) || sent < total )
+        {
+           // skip what was sent and wait for the remainder
+           size_t first = 0;
+           while( sent >= boost::asio::buffer_size(seq[first]) )
+              sent -= boost::asio::buffer_size(seq[first++]);
+           seq[first] = seq[first] + sent;
+
+           detail::const_buffer_range rest( seq + first, seq + count );
+           if( op ) fc::asio::write( s, rest, *op );
+           else     fc::asio::write( s, rest );
+        }
+        return total;
+    }
+
     /** 
-     *  @pre s.non_blocking() == true
      *  @brief wraps boost::asio::async_write_some
+     *
+     *  Like read_some(), the write is attempted synchronously in non-blocking
+     *  mode and only waits on the io_service if it would block.
+     *
      *  @return the number of bytes written
      */
     template<typename AsyncWriteStream, typename ConstBufferSequence>
     size_t write_some( AsyncWriteStream& s, const ConstBufferSequence& buf ) {
+        size_t r = 0;
+        if( detail::try_write_some( s, buf, r ) ) return r;
+
         promise<size_t>::ptr p(new promise<size_t>("fc::asio::write_some"));
         s.async_write_some( buf, boost::bind( detail::read_write_handler, p, _1, _2 ) );
         return p->wait();
     }
 
+    /** 
+     *  Same as write_some() but completes through op instead of allocating
+     *  a new promise and handler.
+     */
+    template<typename AsyncWriteStream, typename ConstBufferSequence>
+    size_t write_some( AsyncWriteStream& s, const ConstBufferSequence& buf, operation& op ) {
+        size_t r = 0;
+        if( detail::try_write_some( s, buf, r ) ) return r;
+
+        auto p = op.acquire();
+        s.async_write_some( buf, detail::reusable_op_handler(p) );
+        return p->wait();
+    }
+
     namespace tcp {
         typedef boost::asio::ip::tcp::endpoint endpoint;
         typedef boost::asio::ip::tcp::resolver::iterator resolver_iterator;
@@ -124,12 +401,24 @@ namespace asio {
         std::vector<endpoint> resolve( const std::string& hostname, const std::string& port );
 
         /** @brief wraps boost::asio::async_accept
+          *
+          * A connection that is already queued is accepted synchronously, so
+          * a loop calling accept() drains a burst of connections without
+          * waiting on the io_service for each of them.
+          *
           * @post sock is connected
-          * @post sock.non_blocking() == true  
           * @throw on error.
           */
         template<typename SocketType, typename AcceptorType>
         void accept( AcceptorType& acc, SocketType& sock ) {
+            detail::non_blocking<AcceptorType> nb;
+            if( nb(acc) || nb(acc,true) ) {
+               boost::system::error_code ec;
+               acc.accept( sock, ec );
+               if( !ec ) return;
+               if( ec != boost::asio::error::would_block && ec != boost::asio::error::try_again ) 
+                  detail::throw_error( ec );
+            }
             //promise<boost::system::error_code>::ptr p( new promise<boost::system::error_code>("fc::asio::tcp::accept") );
             promise<void>::ptr p( new promise<void>("fc::asio::tcp::accept") );
             acc.async_accept( sock, boost::bind( fc::asio::detail::error_handler, p, _1 ) );
@@ -186,6 +475,12 @@ namespace asio {
           {
              return fc::asio::write_some(*_stream, boost::asio::const_buffers_1(buf, len) );
           }
+
+          virtual fc::ostream& writev( const const_buffer* bufs, size_t n )
+          {
+             fc::asio::writev( *_stream, bufs, n );
+             return *this;
+          }
     
           virtual void       close(){ _stream->close(); }
           virtual void       flush() {}
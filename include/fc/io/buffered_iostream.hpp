@@ -12,11 +12,15 @@ namespace fc
    /**
     *  @brief Reads data from an unbuffered stream
     *         and enables peek functionality.
+    *
+    *  Data is read from the underlying stream directly into a fixed
+    *  size ring buffer of bufsize bytes.  Parsers can avoid a call per
+    *  byte by scanning peek_span() and then calling consume().
     */
    class buffered_istream : public virtual istream
    {
       public:
-        buffered_istream( istream_ptr is );
+        buffered_istream( istream_ptr is, size_t bufsize = 4096 );
         buffered_istream( buffered_istream&& o );
 
         buffered_istream& operator=( buffered_istream&& i );
@@ -39,6 +43,31 @@ namespace fc
          */
         char               peek()const;
 
+        /** 
+         *  Reads one character, avoids the virtual readsome() call
+         *  when data is buffered.
+         */
+        char               get();
+
+        /**
+         *  Returns the largest contiguous range of buffered data, blocking
+         *  until at least 1 character is available.  The range remains valid
+         *  until the next call to a non-const method.
+         *
+         *  @throws fc::eof_exception if no more data is available
+         */
+        const_buffer       peek_span()const;
+
+        /**
+         *  Discards n characters from the front of the buffer.
+         *
+         *  @pre n <= peek_span().size
+         */
+        void               consume( size_t n );
+
+        /** bytes read from the underlying stream and no longer buffered */
+        uint64_t           bytes_read()const;
+
       private:
         std::unique_ptr<detail::buffered_istream_impl> my;
    };
@@ -46,7 +75,8 @@ namespace fc
 
 
    /**
-    * 
+    *  @brief Buffers writes to an ostream until flush() is called or
+    *         bufsize bytes have accumulated.
     */
    class buffered_ostream : public virtual ostream
    {
@@ -62,6 +92,13 @@ namespace fc
          */
         virtual size_t  writesome( const char* buf, size_t len );
 
+        /**
+         *  Buffers are copied if they fit in the free space, otherwise the
+         *  buffered data and bufs are handed to the underlying stream
+         *  together in a single writev().
+         */
+        virtual ostream& writev( const const_buffer* bufs, size_t n );
+
         virtual void close();
         virtual void flush();
       private:
@@ -1,18 +1,25 @@
-#pragma once 
+#pragma once
 #include <fc/shared_ptr.hpp>
 #include <fc/filesystem.hpp>
 #include <fc/io/iostream.hpp>
 
 namespace fc {
   class path;
+
+  /**
+   *  Buffered output stream written directly to a file descriptor,
+   *  data is only passed to the OS when the buffer fills, or on
+   *  flush() and close().
+   */
   class ofstream : virtual public ostream {
     public:
       enum mode { out, binary };
+      enum buffer_size_enum { default_buffer_size = 1024*1024 };
       ofstream();
-      ofstream( const fc::path& file, int m = binary );
+      ofstream( const fc::path& file, int m = binary, size_t bufsize = default_buffer_size );
       ~ofstream();
 
-      void open( const fc::path& file, int m = binary );
+      void open( const fc::path& file, int m = binary, size_t bufsize = default_buffer_size );
       size_t writesome( const char* buf, size_t len );
       void   put( char c );
       void   close();
@@ -23,16 +30,26 @@ namespace fc {
       fc::shared_ptr<impl> my;
   };
 
+  /**
+   *  Buffered input stream read directly from a file descriptor.  The
+   *  kernel is told the file will be read sequentially so that it
+   *  reads ahead aggressively.
+   *
+   *  When opened with ifstream::direct the page cache is bypassed (O_DIRECT)
+   *  where supported, which is useful when streaming files much larger than
+   *  memory exactly once.
+   */
   class ifstream : virtual public istream {
     public:
-      enum mode { in, binary };
+      enum mode { in, binary, direct = 2 };
       enum seekdir { beg, cur, end };
+      enum buffer_size_enum { default_buffer_size = 1024*1024 };
 
       ifstream();
-      ifstream( const fc::path& file, int m );
+      ifstream( const fc::path& file, int m, size_t bufsize = default_buffer_size );
       ~ifstream();
 
-      void      open( const fc::path& file, int m );
+      void      open( const fc::path& file, int m, size_t bufsize = default_buffer_size );
       size_t    readsome( char* buf, size_t len );
       ifstream& read( char* buf, size_t len );
       ifstream& seekg( size_t p, seekdir d = beg );
@@ -43,5 +60,5 @@ namespace fc {
       class impl;
       fc::shared_ptr<impl> my;
   };
-  
-} // namespace fc 
+
+} // namespace fc
@@ -5,6 +5,17 @@
 
 namespace fc {
 
+  /**
+   *  A contiguous range of bytes owned by someone else.
+   */
+  struct const_buffer
+  {
+     const_buffer( const char* d = nullptr, size_t s = 0 ):data(d),size(s){}
+
+     const char* data;
+     size_t      size;
+  };
+
   /**
    *  Provides a fc::thread friendly cooperatively multi-tasked stream that
    *  will block 'cooperatively' instead of hard blocking.
@@ -50,6 +61,14 @@ namespace fc {
         * but not flushed. 
         **/
        ostream&   write( const char* buf, size_t len );
+
+       /** 
+        * Writes all n buffers as if by write(), guaranteeing every byte is sent
+        * but not flushed.  Streams that can hand several buffers to the OS in one
+        * call (scatter/gather io) override this, the default calls write() once
+        * per buffer.
+        **/
+       virtual ostream&   writev( const const_buffer* bufs, size_t n );
   };
 
   typedef std::shared_ptr<ostream> ostream_ptr;
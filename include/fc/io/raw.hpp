@@ -12,8 +12,88 @@
 #define MAX_ARRAY_ALLOC_SIZE (1024*1024*10) 
 
 namespace fc { 
+    class sha1;
+    class sha224;
+    class sha256;
+    class sha512;
+
     namespace raw {
 
+    namespace detail {
+      template<typename T, typename IsReflected=typename fc::reflector<T>::is_defined>
+      struct static_packed_size_impl {
+        enum static_packed_size_enum {
+          is_fixed = !fc::is_class<T>::value,
+          value    = is_fixed ? sizeof(T) : 0
+        };
+      };
+
+      template<typename M> struct member_packed_size  { enum _value { value = static_packed_size<M>::value };    };
+      template<typename M> struct member_is_not_fixed { enum _value { value = !static_packed_size<M>::is_fixed }; };
+
+      template<typename T, typename IsEnum=typename fc::reflector<T>::is_enum>
+      struct static_packed_size_reflected {
+        enum static_packed_size_enum {
+          is_fixed = fc::reflector<T>::template member_sum<member_is_not_fixed>::value == 0,
+          value    = is_fixed ? size_t(fc::reflector<T>::template member_sum<member_packed_size>::value) : 0
+        };
+      };
+      template<typename T>
+      struct static_packed_size_reflected<T,fc::true_type> {
+        enum static_packed_size_enum { is_fixed = 0, value = 0 };
+      };
+
+      template<typename T>
+      struct static_packed_size_impl<T,fc::true_type> : public static_packed_size_reflected<T> {};
+
+      template<bool IsFixed> struct packed_size_tag        { typedef fc::false_type type; };
+      template<>             struct packed_size_tag<true>  { typedef fc::true_type  type; };
+
+      /**
+       *  Stream used once the size of a fixed layout type has been checked up front,
+       *  every read/write afterward is a bare memcpy.
+       */
+      template<typename T>
+      class unchecked_datastream {
+        public:
+          unchecked_datastream( T pos ):_pos(pos){}
+
+          inline bool read( char* d, size_t s )        { memcpy( d, _pos, s ); _pos += s; return true; }
+          inline bool write( const char* d, size_t s ) { memcpy( _pos, d, s ); _pos += s; return true; }
+          inline bool put( char c )                    { *_pos = c; ++_pos; return true;                }
+          inline bool get( unsigned char& c )          { return get( *(char*)&c );                      }
+          inline bool get( char& c )                   { c = *_pos; ++_pos; return true;                }
+        private:
+          T _pos;
+      };
+    } // namespace detail
+
+    /**
+     *  Computes at compile time the number of bytes raw::pack() produces for T when that
+     *  number does not depend on the value being packed.  is_fixed is true for integral
+     *  types, fc::array, time points, hashes and any reflected struct made only of
+     *  such members, in which case value is the packed size.  For everything else
+     *  (strings, containers, varints, optionals...) is_fixed is false and value is 0.
+     *
+     *  Records of a fixed layout type can be located in a file at offset
+     *  index * static_packed_size<T>::value without scanning.
+     */
+    template<typename T>
+    struct static_packed_size : public detail::static_packed_size_impl<T> {};
+
+    template<typename T> struct static_packed_size<const T> : public static_packed_size<T> {};
+    template<typename T> struct static_packed_size<T*> { enum static_packed_size_enum { is_fixed = 0, value = 0 }; };
+
+    template<typename T, size_t N>
+    struct static_packed_size< fc::array<T,N> >   { enum static_packed_size_enum { is_fixed = 1, value = N*sizeof(T) }; };
+    template<> struct static_packed_size<bool>           { enum static_packed_size_enum { is_fixed = 1, value = 1 };  };
+    template<> struct static_packed_size<time_point_sec> { enum static_packed_size_enum { is_fixed = 1, value = 4 };  };
+    template<> struct static_packed_size<time_point>     { enum static_packed_size_enum { is_fixed = 1, value = 8 };  };
+    template<> struct static_packed_size<sha1>           { enum static_packed_size_enum { is_fixed = 1, value = 20 }; };
+    template<> struct static_packed_size<sha224>         { enum static_packed_size_enum { is_fixed = 1, value = 28 }; };
+    template<> struct static_packed_size<sha256>         { enum static_packed_size_enum { is_fixed = 1, value = 32 }; };
+    template<> struct static_packed_size<sha512>         { enum static_packed_size_enum { is_fixed = 1, value = 64 }; };
+
     template<typename Stream>
     inline void pack( Stream& s, const fc::time_point_sec& tp )
     {
@@ -119,6 +199,7 @@ namespace fc {
     template<typename Stream> inline void unpack( Stream& s, std::vector<char>& value ) { 
       unsigned_int size; unpack( s, size );
       FC_ASSERT( size.value < MAX_ARRAY_ALLOC_SIZE );
+      detail::check_count( s, size.value );
       value.resize(size.value);
       if( value.size() )
         s.read( value.data(), value.size() );
@@ -298,47 +379,88 @@ namespace fc {
     }
 
 
-    template<typename T>
-    inline std::vector<char> pack(  const T& v ) {
-      datastream<size_t> ps; 
-      raw::pack(ps,v );
-      std::vector<char> vec(ps.tellp());
+    namespace detail {
+      template<typename T>
+      inline std::vector<char> pack( const T& v, fc::false_type /*is_fixed*/ ) {
+        datastream<size_t> ps; 
+        raw::pack(ps,v );
+        std::vector<char> vec(ps.tellp());
+
+        if( vec.size() ) {
+          datastream<char*>  ds( vec.data(), size_t(vec.size()) ); 
+          raw::pack(ds,v);
+        }
+        return vec;
+      }
+
+      template<typename T>
+      inline std::vector<char> pack( const T& v, fc::true_type /*is_fixed*/ ) {
+        std::vector<char> vec( size_t(static_packed_size<T>::value) );
+        if( vec.size() ) {
+          unchecked_datastream<char*> ds( vec.data() );
+          raw::pack(ds,v);
+        }
+        return vec;
+      }
+
+      template<typename T>
+      inline void pack( char* d, uint32_t s, const T& v, fc::false_type /*is_fixed*/ ) {
+        datastream<char*> ds(d,s); 
+        raw::pack(ds,v );
+      }
 
-      if( vec.size() ) {
-        datastream<char*>  ds( vec.data(), size_t(vec.size()) ); 
-        raw::pack(ds,v);
+      template<typename T>
+      inline void pack( char* d, uint32_t s, const T& v, fc::true_type /*is_fixed*/ ) {
+        if( s < size_t(static_packed_size<T>::value) )
+           fc::detail::throw_datastream_range_error( "write", s, static_packed_size<T>::value - s );
+        unchecked_datastream<char*> ds(d); 
+        raw::pack(ds,v );
       }
-      return vec;
+
+      template<typename T>
+      inline void unpack( const char* d, uint32_t s, T& v, fc::false_type /*is_fixed*/ ) {
+        datastream<const char*>  ds( d, s );
+        raw::unpack(ds,v);
+      }
+
+      template<typename T>
+      inline void unpack( const char* d, uint32_t s, T& v, fc::true_type /*is_fixed*/ ) {
+        if( s < size_t(static_packed_size<T>::value) )
+           fc::detail::throw_datastream_range_error( "read", s, static_packed_size<T>::value - s );
+        unchecked_datastream<const char*>  ds( d );
+        raw::unpack(ds,v);
+      }
+    } // namespace detail
+
+    template<typename T>
+    inline std::vector<char> pack(  const T& v ) {
+      return detail::pack( v, typename detail::packed_size_tag<static_packed_size<T>::is_fixed>::type() );
     }
 
     template<typename T>
     inline T unpack( const std::vector<char>& s ) {
       T tmp;
       if( s.size() ) {
-        datastream<const char*>  ds( s.data(), size_t(s.size()) ); 
-        raw::unpack(ds,tmp);
+        detail::unpack( s.data(), uint32_t(s.size()), tmp, 
+                        typename detail::packed_size_tag<static_packed_size<T>::is_fixed>::type() );
       }
       return tmp;
     }
 
     template<typename T>
     inline void pack( char* d, uint32_t s, const T& v ) {
-      datastream<char*> ds(d,s); 
-      raw::pack(ds,v );
+      detail::pack( d, s, v, typename detail::packed_size_tag<static_packed_size<T>::is_fixed>::type() );
     }
 
     template<typename T>
     inline T unpack( const char* d, uint32_t s ) {
       T v;
-      datastream<const char*>  ds( d, s );
-      raw::unpack(ds,v);
+      detail::unpack( d, s, v, typename detail::packed_size_tag<static_packed_size<T>::is_fixed>::type() );
       return v;
     }
     template<typename T>
     inline void unpack( const char* d, uint32_t s, T& v ) {
-      datastream<const char*>  ds( d, s );
-      raw::unpack(ds,v);
-      return v;
+      detail::unpack( d, s, v, typename detail::packed_size_tag<static_packed_size<T>::is_fixed>::type() );
     }
     
 } } // namespace fc::raw
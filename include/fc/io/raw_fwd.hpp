@@ -1,6 +1,7 @@
 #pragma once
 #include <fc/io/varint.hpp>
 #include <fc/array.hpp>
+#include <fc/io/datastream.hpp>
 #include <vector>
 #include <string>
 #include <unordered_set>
@@ -15,6 +16,8 @@ namespace fc {
    namespace ecc { class public_key; class private_key; }
    namespace raw {
 
+    template<typename T> struct static_packed_size;
+
     template<typename Stream, typename T> inline void pack( Stream& s, const std::set<T>& value );
     template<typename Stream, typename T> inline void unpack( Stream& s, std::set<T>& value );
     template<typename Stream, typename T> inline void pack( Stream& s, const std::unordered_set<T>& value );
@@ -61,6 +64,21 @@ namespace fc {
     template<typename Stream> inline void pack( Stream& s, const bool& v );
     template<typename Stream> inline void unpack( Stream& s, bool& v );
 
+    namespace detail {
+      /**
+       *  Rejects an element count read off the wire that is larger than the
+       *  bytes left in a bounded datastream.  Every element takes at least one
+       *  byte, so such a count can only come from a malformed frame and must
+       *  not be used to size an allocation.  Other streams are not checked.
+       */
+      template<typename Stream> inline void check_count( Stream&, uint64_t ) {}
+      template<typename T> inline void check_count( datastream<T>& s, uint64_t count ) {
+        if( count > s.remaining() )
+          fc::detail::throw_datastream_range_error( "unpack", s.remaining(), count - s.remaining() );
+      }
+      inline void check_count( datastream<size_t>&, uint64_t ) {}
+    }
+
     template<typename T> inline std::vector<char> pack( const T& v );
     template<typename T> inline T unpack( const std::vector<char>& s );
     template<typename T> inline T unpack( const char* d, uint32_t s );
@@ -97,8 +97,12 @@ namespace fc { namespace raw {
          }
          case variant::array_type:
          {
-            variants val;
-            raw::unpack(s,val);
+            unsigned_int size;
+            raw::unpack(s,size);
+            detail::check_count( s, size.value );
+            variants val(size.value);
+            for( uint32_t i = 0; i < size.value; ++i )
+               raw::unpack(s,val[i]);
             v = fc::move(val);
             return;
          }
@@ -131,9 +135,11 @@ namespace fc { namespace raw {
        unsigned_int vs;
        unpack( s, vs );
 
+       detail::check_count( s, vs.value );
+
        mutable_variant_object mvo;
        mvo.reserve(vs.value);
-       for( auto i = 0; i < vs.value; ++i )
+       for( uint32_t i = 0; i < vs.value; ++i )
        {
           fc::string key;
           fc::variant value;
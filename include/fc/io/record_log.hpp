@@ -0,0 +1,168 @@
+#pragma once
+#include <fc/io/raw.hpp>
+#include <fc/filesystem.hpp>
+#include <memory>
+
+namespace fc
+{
+   namespace detail
+   {
+      class record_log_impl;
+      class record_log_reader_impl;
+   }
+
+   /**
+    *  @brief append only file of length + CRC32C framed records
+    *
+    *  Each record is stored as:
+    *
+    *  @code
+    *    uint32_t size;    // payload size, never 0
+    *    uint32_t crc;     // crc32c of size followed by the payload
+    *    char     data[size];
+    *  @endcode
+    *
+    *  Records are buffered in memory and written in batches, the file is only
+    *  fdatasync'd every sync_interval records or when sync() is called.  A record
+    *  that was only partially written when the process died (a torn tail) fails
+    *  its CRC and is truncated when the log is opened again.  The size is
+    *  covered by the CRC and may not be 0, so a zero filled tail never passes
+    *  as a valid record.
+    *
+    *  There is no marker to find the next record by, so everything after the
+    *  first invalid record is unreachable.  A record corrupted in the middle of
+    *  the file therefore loses every record after it once the log is opened.
+    */
+   class record_log
+   {
+      public:
+        struct config
+        {
+           config()
+           :sync_interval(1024),max_batch_bytes(1024*1024){}
+
+           /** number of appended records between calls to fdatasync, 0 disables
+            *  syncing except through sync() and close() */
+           uint32_t sync_interval;
+           /** buffered bytes that trigger a write to the file */
+           uint32_t max_batch_bytes;
+        };
+
+        record_log();
+        record_log( const fc::path& file, const config& c = config() );
+        record_log( record_log&& m );
+        ~record_log();
+
+        record_log& operator=( record_log&& m );
+
+        /**
+         *  Opens or creates file, validating the existing records and
+         *  truncating the file after the last record that is valid, which
+         *  discards a torn tail along with any valid records that follow a
+         *  corrupt one.  recovered_bytes() reports how much was discarded.
+         */
+        void      open( const fc::path& file, const config& c = config() );
+
+        /**
+         *  @param len - must not be 0
+         *  @return the file offset of the new record
+         */
+        uint64_t  append( const char* data, uint32_t len );
+
+        template<typename T>
+        uint64_t  append( const T& v )
+        {
+           auto d = fc::raw::pack(v);
+           return append( d.data(), uint32_t(d.size()) );
+        }
+
+        /** writes buffered records to the file without syncing */
+        void      flush();
+        /** writes buffered records and waits for them to reach the disk */
+        void      sync();
+        void      close();
+
+        /** offset one past the last appended record, including buffered records */
+        uint64_t  size()const;
+        /** bytes discarded from the tail of the file when it was opened */
+        uint64_t  recovered_bytes()const;
+
+      private:
+        std::unique_ptr<detail::record_log_impl> my;
+   };
+
+   /**
+    *  A view of a record that points directly into the mapped file and is
+    *  only valid as long as the record_log_reader it came from.
+    */
+   struct record_view
+   {
+      record_view():offset(0),data(nullptr),size(0){}
+
+      template<typename T>
+      T as()const { return fc::raw::unpack<T>( data, size ); }
+
+      uint64_t     offset;
+      const char*  data;
+      uint32_t     size;
+   };
+
+   /**
+    *  @brief maps a record_log read only and iterates its records
+    *
+    *  Any number of readers may be opened on a file while a record_log is
+    *  appending to it.  A reader sees the records that were complete when it
+    *  was opened (or last refreshed); iteration stops at the first record that
+    *  is incomplete or fails its CRC.
+    */
+   class record_log_reader
+   {
+      public:
+        class iterator
+        {
+           public:
+             iterator():_reader(nullptr){}
+
+             const record_view& operator*()const  { return _view;  }
+             const record_view* operator->()const { return &_view; }
+             iterator&          operator++();
+
+             friend bool operator==( const iterator& a, const iterator& b ) { return a._view.offset == b._view.offset; }
+             friend bool operator!=( const iterator& a, const iterator& b ) { return a._view.offset != b._view.offset; }
+
+           private:
+             friend class record_log_reader;
+             iterator( const record_log_reader* r, uint64_t pos );
+
+             const record_log_reader* _reader;
+             record_view              _view;
+        };
+
+        record_log_reader();
+        record_log_reader( const fc::path& file );
+        record_log_reader( record_log_reader&& m );
+        ~record_log_reader();
+
+        record_log_reader& operator=( record_log_reader&& m );
+
+        void     open( const fc::path& file );
+        /** remaps the file to pick up records appended since it was opened */
+        void     refresh();
+        void     close();
+
+        iterator begin()const;
+        /** @param offset - must be an offset returned by record_log::append() */
+        iterator begin_at( uint64_t offset )const;
+        iterator end()const;
+
+        /** offset one past the last valid record */
+        uint64_t valid_size()const;
+
+      private:
+        /** reads the record at pos into v, returns false if it is missing or corrupt */
+        bool     read_record( uint64_t pos, record_view& v )const;
+
+        std::unique_ptr<detail::record_log_reader_impl> my;
+   };
+
+} // namespace fc
@@ -0,0 +1,56 @@
+#pragma once
+#include <fc/network/http/connection.hpp>
+#include <fc/thread/future.hpp>
+#include <fc/time.hpp>
+#include <memory>
+
+namespace fc { namespace http {
+
+  /**
+   *  Issues HTTP requests over a pool of keep-alive connections per host.
+   *
+   *  Each request is assigned to the least loaded connection to its host,
+   *  a new connection is opened while every existing one is busy and there
+   *  are fewer than max_connections_per_host.  Up to max_pipeline_depth
+   *  requests are pipelined on a connection, beyond that requests wait in a
+   *  per-host queue, so any number of concurrent calls share a bounded set of
+   *  sockets.
+   *
+   *  The pool is owned by the thread that created the client, request() may
+   *  be called from any thread.
+   */
+  class client
+  {
+    public:
+      struct config
+      {
+         config()
+         :max_connections_per_host(8),max_pipeline_depth(16),timeout(fc::seconds(30)){}
+
+         uint32_t         max_connections_per_host;
+         /** requests sent on a connection before the reply to the first is read */
+         uint32_t         max_pipeline_depth;
+         /**
+          *  time from request() until the reply is read, after which the future
+          *  fails with timeout_exception.  A connection whose oldest request
+          *  times out is closed, failing the requests pipelined behind it.
+          */
+         fc::microseconds timeout;
+      };
+
+      client( const config& c = config() );
+      ~client();
+
+      fc::future<http::reply> request( const fc::ip::endpoint& host, const fc::string& method,
+                                       const fc::string& path, const fc::string& body = fc::string(),
+                                       const headers& h = headers() );
+
+      /** closes every connection, outstanding requests fail with canceled_exception */
+      void close();
+
+    private:
+      class impl;
+      std::shared_ptr<impl> my;
+  };
+
+} } // fc::http
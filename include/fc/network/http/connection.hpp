@@ -1,6 +1,7 @@
 #pragma once
 #include <fc/vector.hpp>
 #include <fc/string.hpp>
+#include <fc/io/iostream.hpp>
 #include <memory>
 
 namespace fc { 
@@ -25,7 +26,9 @@ namespace fc {
         enum status_code {
             OK                  = 200,
             RecordCreated       = 201,
+            BadRequest          = 400,
             NotFound            = 404,
+            MethodNotAllowed    = 405,
             Found               = 302,
             InternalServerError = 500
         };
@@ -38,7 +41,13 @@ namespace fc {
      struct request 
      {
         fc::string get_header( const fc::string& key )const;
+        /** 
+         *  @return true unless the client asked to close the connection, HTTP/1.0
+         *  clients must ask for keep-alive explicitly
+         */
+        bool       keep_alive()const;
         fc::string              method;
+        fc::string              version;
         fc::string              domain;
         fc::string              path;
         std::vector<header>      headers;
@@ -50,20 +59,61 @@ namespace fc {
      /**
       *  Connections have reference semantics, all copies refer to the same
       *  underlying socket.  
+      *
+      *  Requests and replies are parsed incrementally out of a buffer owned by
+      *  the connection, so any number of pipelined messages may be queued on
+      *  the socket and the connection is kept open between them unless the
+      *  peer asks for it to be closed.
       */
      class connection 
      {
        public:
-         connection();
+         struct config
+         {
+            config():max_body_size(64*1024*1024),max_header_size(64*1024){}
+
+            /**
+             *  largest body read, whether it has a Content-Length or is chunked,
+             *  a larger one throws and leaves the connection unusable
+             */
+            uint64_t max_body_size;
+            /**
+             *  most bytes of header lines read for one message, and separately
+             *  for the trailer of a chunked body, more throws like max_body_size
+             */
+            uint64_t max_header_size;
+         };
+
+         connection( const config& c = config() );
          ~connection();
          // used for clients
          void         connect_to( const fc::ip::endpoint& ep );
+         /** on failure the connection is closed and an InternalServerError reply returned */
          http::reply  request( const fc::string& method, const fc::string& url, const fc::string& body, const headers& = headers());
+         /**
+          *  Sends a request without waiting for the reply so that several
+          *  requests can be pipelined, the replies are read in the same order
+          *  with read_reply(), which throws if the reply cannot be read.
+          */
+         void         send_request( const fc::string& method, const fc::string& url, const fc::string& body, const headers& = headers());
+         http::reply  read_reply();
+         /** reads the status line and headers, the body is read from body_stream() */
+         http::reply  read_reply_headers();
      
          // used for servers
          fc::tcp_socket& get_socket()const;
      
          http::request    read_request()const;
+         /** reads the request line and headers, the body is read from body_stream() */
+         http::request    read_request_headers()const;
+
+         /**
+          *  Streams the body of the message whose headers were read last,
+          *  decoding chunked transfer encoding, and throws eof_exception at the
+          *  end of the body.  Whatever is left unread is skipped when the next
+          *  message is read.  The stream must not outlive the connection.
+          */
+         fc::istream_ptr  body_stream()const;
 
          class impl;
        private:
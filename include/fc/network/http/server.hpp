@@ -16,7 +16,8 @@ namespace fc { namespace http {
   {
     public:
       server();
-      server( uint16_t port );
+      /** @param c - used for every connection accepted */
+      server( uint16_t port, const connection::config& c = connection::config() );
       server( server&& s );
       ~server();
 
@@ -39,19 +40,36 @@ namespace fc { namespace http {
           void set_status( const http::reply::status_code& s )const;
           void set_length( uint64_t s )const;
 
+          /**
+           *  If set_length() was not called before the first write the body is
+           *  sent with chunked transfer encoding, it ends when the last copy of
+           *  the response is destroyed or its body_stream() is closed.
+           */
           void write( const char* data, uint64_t len )const;
 
+          /** writes the body as it is produced, @see write() */
+          fc::ostream_ptr body_stream()const;
+
         private:
           fc::shared_ptr<impl> my;
       };
 
-      void listen( uint16_t p );
+      void listen( uint16_t p, const connection::config& c = connection::config() );
 
       /**
        *  Set the callback to be called for every http request made.
        */
       void on_request( const std::function<void(const http::request&, const server::response& s )>& cb );
 
+      typedef std::function<void(const http::request&, const fc::istream_ptr& body, const server::response& s )> stream_request_handler;
+      /**
+       *  Replaces on_request() with a callback that is called as soon as the
+       *  headers have been read, request::body is left empty and the body is
+       *  read from the body stream instead.  Any part of the body the callback
+       *  does not read is skipped.
+       */
+      void on_stream_request( const stream_request_handler& cb );
+
     private:
       class impl;
       std::unique_ptr<impl> my;
@@ -2,19 +2,38 @@
 #include <fc/string.hpp>
 #include <fc/crypto/sha1.hpp>
 #include <fc/io/raw_fwd.hpp>
+#include <fc/exception/exception.hpp>
+#include <array>
 
 namespace fc {
 
   namespace ip {
+    /**
+     *  An IPv4 or IPv6 address held inline in 16 bytes.  IPv4 addresses are
+     *  stored in their IPv4-mapped form (::ffff:a.b.c.d) so that an address
+     *  accepted on a dual-stack socket compares equal to the same address
+     *  given as a dotted quad.
+     */
     class address {
       public:
+        /** raw IPv6 address in network byte order */
+        typedef std::array<unsigned char,16> v6_bytes;
+
+        /** @param _ip - IPv4 address in host byte order */
         address( uint32_t _ip = 0 );
+        explicit address( const v6_bytes& b );
+        /** accepts either a dotted quad or an IPv6 address */
         address( const fc::string& s );
 
         address& operator=( const fc::string& s );
         operator fc::string()const;
+        /** @pre is_v4() */
         operator uint32_t()const;
 
+        bool            is_v4()const;
+        bool            is_v6()const { return !is_v4(); }
+        const v6_bytes& to_v6_bytes()const { return _ip; }
+
         friend bool operator==( const address& a, const address& b );
         friend bool operator!=( const address& a, const address& b );
 
@@ -25,18 +44,21 @@ namespace fc {
          *  172.16.0.0  to 172.31.255.255
          *  192.168.0.0 to 192.168.255.255
          *  169.254.0.0 to 169.254.255.255
+         *  fc00::/7 (unique local) and fe80::/10 (link local)
          *
          */
         bool is_private_address()const;
         /**
-         *  224.0.0.0 to 239.255.255.255
+         *  224.0.0.0 to 239.255.255.255 and ff00::/8
          */
         bool is_multicast_address()const;
 
         /** !private & !multicast */
         bool is_public_address()const;
+
+        friend bool operator<( const address& a, const address& b );
       private:
-        uint32_t _ip;
+        v6_bytes _ip;
     };
     
     class endpoint {
@@ -44,9 +66,9 @@ namespace fc {
         endpoint();
         endpoint( const address& i, uint16_t p = 0);
 
-        /** Converts "IP:PORT" to an endpoint */
+        /** Converts "IP:PORT" or "[IPv6]:PORT" to an endpoint */
         static endpoint from_string( const string& s );
-        /** returns "IP:PORT" */
+        /** returns "IP:PORT", IPv6 addresses are enclosed in brackets */
         operator string()const;
 
         void           set_port(uint16_t p ) { _port = p; }
@@ -59,7 +81,7 @@ namespace fc {
     
       private:
         /**
-         *  The compiler pads endpoint to a full 8 bytes, so while
+         *  The compiler pads endpoint to a multiple of 4 bytes, so while
          *  a port number is limited in range to 16 bits, we specify
          *  a full 32 bits so that memcmp can be used with sizeof(), 
          *  otherwise 2 bytes will be 'random' and you do not know 
@@ -77,11 +99,37 @@ namespace fc {
   void to_variant( const ip::address& var,  variant& vo );
   void from_variant( const variant& var,  ip::address& vo );
 
+  namespace ip {
+    /**
+     *  Packs an address of either family as its version, 4 or 6, followed by
+     *  the 4 or 16 bytes of the address.  Formats that must carry IPv6 use this
+     *  in place of a plain address, whose packed form is the 4 byte IPv4
+     *  address that existing data and peers expect.
+     */
+    struct versioned_address {
+      versioned_address(){}
+      versioned_address( const address& a ):addr(a){}
+      address addr;
+    };
+
+    /** an endpoint packed as a versioned_address and the port */
+    struct versioned_endpoint {
+      versioned_endpoint(){}
+      versioned_endpoint( const endpoint& e ):ep(e){}
+      endpoint ep;
+    };
+  }
+
   namespace raw 
   {
+    /**
+     *  packed as the 4 byte IPv4 address in host byte order, an IPv6 address
+     *  can not be packed this way, @see ip::versioned_address
+     */
     template<typename Stream> 
     inline void pack( Stream& s, const ip::address& v )
     {
+       FC_ASSERT( v.is_v4(), "only IPv4 addresses can be packed without a version, use ip::versioned_address" );
        fc::raw::pack( s, uint32_t(v) );
     }
     template<typename Stream> 
@@ -108,6 +156,52 @@ namespace fc {
        v = ip::endpoint(a,p);
     }
 
+    template<typename Stream> 
+    inline void pack( Stream& s, const ip::versioned_address& v )
+    {
+       if( v.addr.is_v4() )
+       {
+          fc::raw::pack( s, uint8_t(4) );
+          fc::raw::pack( s, v.addr );
+       }
+       else
+       {
+          fc::raw::pack( s, uint8_t(6) );
+          s.write( (const char*)v.addr.to_v6_bytes().data(), v.addr.to_v6_bytes().size() );
+       }
+    }
+    template<typename Stream> 
+    inline void unpack( Stream& s, ip::versioned_address& v )
+    {
+       uint8_t version;
+       fc::raw::unpack( s, version );
+       if( version == 4 )
+       {
+          fc::raw::unpack( s, v.addr );
+          return;
+       }
+       FC_ASSERT( version == 6, "unknown IP version ${v}", ("v",version) );
+       ip::address::v6_bytes b;
+       s.read( (char*)b.data(), b.size() );
+       v.addr = ip::address(b);
+    }
+
+    template<typename Stream> 
+    inline void pack( Stream& s, const ip::versioned_endpoint& v )
+    {
+       fc::raw::pack( s, ip::versioned_address( v.ep.get_address() ) );
+       fc::raw::pack( s, v.ep.port() );
+    }
+    template<typename Stream> 
+    inline void unpack( Stream& s, ip::versioned_endpoint& v )
+    {
+       ip::versioned_address a;
+       uint16_t p;
+       fc::raw::unpack( s, a );
+       fc::raw::unpack( s, p );
+       v.ep = ip::endpoint(a.addr,p);
+    }
+
   }
 }
 namespace std
@@ -2,9 +2,12 @@
 #include <fc/utility.hpp>
 #include <fc/fwd.hpp>
 #include <fc/io/iostream.hpp>
+#include <functional>
+#include <vector>
 
 namespace fc {
   namespace ip { class endpoint; } 
+  class thread;
   class tcp_socket : public virtual iostream 
   {
     public:
@@ -23,6 +26,7 @@ namespace fc {
       /// ostream interface
       /// @{
       virtual size_t   writesome( const char* buffer, size_t len );
+      virtual ostream& writev( const const_buffer* bufs, size_t n );
       virtual void     flush();
       virtual void     close();
       /// @}
@@ -32,7 +36,7 @@ namespace fc {
     private:
       friend class tcp_server;
       class impl;
-      fc::fwd<impl,0x44> my;
+      fc::fwd<impl,0x64> my;
   };
   typedef std::shared_ptr<tcp_socket> tcp_socket_ptr;
 
@@ -40,12 +44,33 @@ namespace fc {
   class tcp_server 
   {
     public:
+      struct config
+      {
+         config()
+         :backlog(1024),reuse_address(true),reuse_port(false),no_delay(false),keep_alive(false){}
+
+         /** maximum length of the queue of pending connections */
+         uint32_t backlog;
+         bool     reuse_address;
+         /** 
+          *  SO_REUSEPORT, lets several listening sockets bind the same port and
+          *  has the kernel spread incoming connections between them.  Ignored
+          *  where it is not supported.
+          */
+         bool     reuse_port;
+         /** TCP_NODELAY for accepted sockets */
+         bool     no_delay;
+         /** SO_KEEPALIVE for accepted sockets */
+         bool     keep_alive;
+      };
+
       tcp_server();
       ~tcp_server();
 
       void close();
+      /** @return false once closed, including when close() ends a pending accept */
       bool accept( tcp_socket& s );
-      void listen( uint16_t port );
+      void listen( uint16_t port, const config& c = config() );
     
     private:
       // non copyable
@@ -56,5 +81,39 @@ namespace fc {
       impl* my;
   };
 
+  /**
+   *  @brief accepts connections for one port on several threads
+   *
+   *  Each thread listens with its own SO_REUSEPORT socket and runs its own
+   *  accept loop, so a storm of connections does not serialize on a single
+   *  accept loop and every connection is handled on the thread that accepted it.
+   *  Where SO_REUSEPORT is not supported only the first thread accepts.
+   */
+  class tcp_server_group
+  {
+    public:
+      typedef std::function<void(const tcp_socket_ptr&)> accept_handler;
+
+      tcp_server_group();
+      ~tcp_server_group();
+
+      /**
+       *  Starts an accept loop on each of threads, on_accept is called in a new 
+       *  task on the accepting thread for every connection.
+       */
+      void listen( uint16_t port, const std::vector<fc::thread*>& threads, 
+                   const accept_handler& on_accept, 
+                   const tcp_server::config& c = tcp_server::config() );
+      void close();
+
+    private:
+      // non copyable
+      tcp_server_group( const tcp_server_group& ); 
+      tcp_server_group& operator=(const tcp_server_group& s );
+
+      class impl;
+      std::unique_ptr<impl> my;
+  };
+
 } // namesapce fc
 
@@ -1,12 +1,9 @@
 #pragma once
 #include <fc/utility.hpp>
 #include <fc/shared_ptr.hpp>
+#include <fc/network/ip.hpp>
 
 namespace fc {
-  namespace ip {
-    class endpoint;
-    class address;
-  }
 
   /**
    *  The udp_socket class has reference semantics, all copies will
@@ -14,6 +11,32 @@ namespace fc {
    */
   class udp_socket {
     public:
+      /** one slot of receive_batch() or send_batch() */
+      struct datagram {
+        datagram():data(nullptr),size(0),length(0),segment_size(0),truncated(false){}
+        datagram( char* d, size_t s ):data(d),size(s),length(0),segment_size(0),truncated(false){}
+
+        char*            data;
+        /** capacity of data, used by receive_batch() */
+        size_t           size;
+        /** bytes received, or the bytes to send */
+        size_t           length;
+        /** 
+         *  When non-zero, data holds length bytes split into datagrams of
+         *  segment_size bytes (the last may be shorter).  send_batch() has the
+         *  kernel do the split (UDP GSO), receive_batch() reports it for
+         *  datagrams coalesced by UDP GRO, @see enable_gro()
+         */
+        size_t           segment_size;
+        /**
+         *  set by receive_batch() when the datagram was larger than size and
+         *  the rest of it was discarded, where the platform reports it
+         */
+        bool             truncated;
+        /** source of a received datagram, destination of a sent one */
+        fc::ip::endpoint endpoint;
+      };
+
       udp_socket();
       udp_socket( const udp_socket& s );
       ~udp_socket();
@@ -23,6 +46,30 @@ namespace fc {
       void   bind( const fc::ip::endpoint& );
       size_t receive_from( char* b, size_t l, fc::ip::endpoint& from );
       size_t send_to( const char* b, size_t l, const fc::ip::endpoint& to ); 
+
+      /**
+       *  Waits until at least one datagram is available and then receives as
+       *  many as are queued, up to n, in a single system call where the
+       *  platform supports it (recvmmsg).  Concurrent calls on the same
+       *  socket take turns.
+       *
+       *  @return the number of slots filled
+       */
+      size_t receive_batch( datagram* d, size_t n );
+      /**
+       *  Sends all n datagrams, as many per system call as the platform
+       *  supports (sendmmsg).  Concurrent calls on the same socket take turns,
+       *  each batch is sent whole.
+       *
+       *  @return n
+       */
+      size_t send_batch( const datagram* d, size_t n );
+      /** 
+       *  Lets the kernel coalesce consecutive datagrams from the same peer
+       *  into one receive_batch() slot (UDP GRO), a no-op where unsupported.
+       *  @return true if enabled
+       */
+      bool   enable_gro( bool e = true );
       void   close();
 
       void   set_multicast_enable_loopback( bool );
@@ -1,5 +1,6 @@
 #pragma once 
-#include <fc/future.hpp>
+#include <fc/thread/future.hpp>
+#include <fc/shared_ptr.hpp>
 #include <functional>
 #include <boost/config.hpp>
 #include <boost/preprocessor/repeat.hpp>
@@ -59,6 +59,16 @@ struct reflector{
     #ifdef DOXYGEN
     template<typename Visitor>
     static inline void visit( const Visitor& v ); 
+
+    /**
+     *  Compile time counterpart of visit(), evaluates to the sum of
+     *  Trait<Member>::value for every member of T including those of
+     *  reflected base classes.
+     *
+     *  @note - this is only defined for types reflected with FC_REFLECT or FC_REFLECT_DERIVED
+     */
+    template<template<typename> class Trait>
+    struct member_sum { enum member_sum_enum { value }; };
     #endif // DOXYGEN
 };
 
@@ -93,6 +103,12 @@ void throw_bad_enum_cast( const char* k, const char* e );
 #define FC_REFLECT_MEMBER_COUNT( r, OP, elem ) \
   OP 1
 
+#define FC_REFLECT_BASE_MEMBER_SUM( r, TRAIT, base ) \
+  + fc::reflector<base>::template member_sum<TRAIT>::value
+
+#define FC_REFLECT_MEMBER_SUM( r, TRAIT, elem ) \
+  + TRAIT< decltype(((type*)nullptr)->elem) >::value
+
 #define FC_REFLECT_DERIVED_IMPL_INLINE( TYPE, INHERITS, MEMBERS ) \
 template<typename Visitor>\
 static inline void visit( const Visitor& v ) { \
@@ -166,6 +182,13 @@ template<> struct reflector<TYPE> {\
       local_member_count = 0  BOOST_PP_SEQ_FOR_EACH( FC_REFLECT_MEMBER_COUNT, +, MEMBERS ),\
       total_member_count = local_member_count BOOST_PP_SEQ_FOR_EACH( FC_REFLECT_BASE_MEMBER_COUNT, +, INHERITS )\
     }; \
+    template<template<typename> class Trait> \
+    struct member_sum { \
+      enum member_sum_enum { \
+        value = 0 BOOST_PP_SEQ_FOR_EACH( FC_REFLECT_BASE_MEMBER_SUM, Trait, INHERITS ) \
+                  BOOST_PP_SEQ_FOR_EACH( FC_REFLECT_MEMBER_SUM, Trait, MEMBERS ) \
+      }; \
+    }; \
     FC_REFLECT_DERIVED_IMPL_INLINE( TYPE, INHERITS, MEMBERS ) \
 }; } 
 
@@ -4,6 +4,7 @@
 #include <fc/thread/future.hpp>
 #include <fc/log/logger.hpp>
 #include <functional>
+#include <vector>
 
 namespace fc { namespace rpc  {
 
@@ -14,14 +15,130 @@ namespace fc { namespace rpc  {
     *
     * Each JSON RPC message is expected to be on its own line, violators
     * will be prosecuted to the fullest extent of the law.
+    *
+    * The same messages may instead be sent as fc::raw packed variants with a
+    * size prefix, which avoids formatting and parsing JSON text.  The format
+    * is chosen per message, so a client configured for binary_format can talk
+    * to any server that accepts it and the server replies in kind.
     */
    class json_connection
    {
       public:
          typedef std::function<variant(const variants&)>       method;
          typedef std::function<variant(const variant_object&)> named_param_method;
+         /**
+          *  receives the params exactly as they were sent, an array, an object,
+          *  null if there were none or anything else a generic call sent
+          */
+         typedef std::function<variant(const variant&)>        generic_method;
+         /** called with the result, or with the exception if the call failed */
+         typedef std::function<void(const variant&,const fc::exception_ptr&)> reply_handler;
+         /** receives a whole reply or batch of replies, or null if none is due */
+         typedef std::function<void(const variant&)>           message_handler;
+         /** receives each message published to a subscribed topic */
+         typedef std::function<void(const variant&)>           event_handler;
+
+         enum wire_format
+         {
+            json_format,
+            binary_format
+         };
+
+         /**
+          *  Outgoing messages are serialized into a buffer that a single writer
+          *  task sends and flushes, so messages queued while a write is in
+          *  progress go out together with one flush.
+          */
+         struct config
+         {
+            config()
+            :max_batch_bytes(64*1024),max_batch_latency(0),max_outbox_bytes(1024*1024),max_in_flight(256),
+             format(json_format),accept_binary(true),max_message_size(64*1024*1024),
+             call_timeout(fc::microseconds::maximum()){}
+
+            /** largest write, a batch is split at message boundaries */
+            uint32_t          max_batch_bytes;
+            /**
+             *  how long the writer waits for more messages before sending a batch
+             *  smaller than max_batch_bytes, 0 sends as soon as the writer runs
+             */
+            fc::microseconds  max_batch_latency;
+            /**
+             *  serialized messages waiting for the writer, once reached sending
+             *  waits until the writer takes a batch, 0 for no limit
+             */
+            uint32_t          max_outbox_bytes;
+
+            /**
+             *  requests being handled or waiting on a method limit, once reached
+             *  no more input is read until one completes, 0 for no limit
+             */
+            uint32_t             max_in_flight;
+            /**
+             *  handlers are run on these threads in turn, or on the thread that
+             *  called exec() if empty.  Handlers may then run concurrently with
+             *  each other, but not with add_method()/remove_method().
+             */
+            std::vector<fc::thread*> handler_threads;
+
+            /** the format messages are sent in */
+            wire_format          format;
+            /** switch to binary_format once the remote side sends a binary message */
+            bool                 accept_binary;
+            /** binary messages larger than this close the connection */
+            uint32_t             max_message_size;
+
+            /**
+             *  the deadline of calls made without one, maximum for none.  A call
+             *  fails with timeout_exception once its deadline passes.  The time
+             *  left is sent with the call and the remote side does not start it
+             *  once that has passed.
+             */
+            fc::microseconds     call_timeout;
+         };
+
+         /** what publish() does with a message for a subscriber whose queue is full */
+         enum overflow_policy
+         {
+            drop_oldest,
+            drop_newest,
+            /**
+             *  the message replaces a queued one with the same coalesce_key even
+             *  if the queue is not full, otherwise the oldest is dropped
+             */
+            coalesce
+         };
+
+         /**
+          *  Messages published to a topic are queued for each subscriber and
+          *  sent while it has credit, which the subscriber grants as it handles
+          *  them, so a slow subscriber only holds up its own queue.
+          */
+         struct topic_config
+         {
+            topic_config():max_queue(1024),policy(drop_oldest){}
+
+            /** messages held for a subscriber that is out of credit */
+            uint32_t                                  max_queue;
+            overflow_policy                           policy;
+            /** if not set every message has the same key, so coalesce keeps only the latest */
+            std::function<fc::string(const variant&)> coalesce_key;
+         };
+
+         /** one call of a batch sent with async_batch() */
+         struct batch_call
+         {
+            batch_call( const fc::string& m, const variants& args = variants() )
+            :method(m),params(args){}
+            batch_call( const fc::string& m, const variant_object& named_args )
+            :method(m),params(named_args){}
+
+            fc::string method;
+            /** an array of positional or an object of named params */
+            variant    params;
+         };
 
-         json_connection( fc::buffered_istream_ptr in, fc::buffered_ostream_ptr out );
+         json_connection( fc::buffered_istream_ptr in, fc::buffered_ostream_ptr out, const config& c = config() );
          ~json_connection();
 
          /**
@@ -30,8 +147,22 @@ namespace fc { namespace rpc  {
          future<void> exec();
 
          logger get_logger()const;
+         /** the format messages are currently sent in */
+         wire_format get_format()const;
+         /** every message sent and received is logged at debug level, which is off by default */
          void   set_logger( const logger& l );
 
+         /**
+          *  Counts of the messages and bytes sent and received, the calls in
+          *  flight and, for each method that has been called, its calls, errors
+          *  and histograms of the time calls spent queued, handled and
+          *  serializing their replies.  The remote side gets the same with the
+          *  built in rpc.stats method.
+          *
+          *  Must be called on the thread that runs exec().
+          */
+         variant_object get_stats()const;
+
          /**
           * @name server interface
           *
@@ -39,11 +170,55 @@ namespace fc { namespace rpc  {
           * to call them.
           */
          ///@{ 
-         void add_method( const fc::string& name, method );
-         void add_method( const fc::string& name, named_param_method );
+         /**
+          *  @param max_concurrency - calls of this method handled at once, others
+          *         wait in order and count towards max_in_flight, 0 for no limit
+          */
+         void add_method( const fc::string& name, method, uint32_t max_concurrency = 0 );
+         void add_method( const fc::string& name, named_param_method, uint32_t max_concurrency = 0 );
+         /** takes precedence over a method or named_param_method of the same name */
+         void add_generic_method( const fc::string& name, generic_method, uint32_t max_concurrency = 0 );
          void remove_method( const fc::string& name );
+
+         /**
+          *  Handles a request, notification or batch that arrived some other
+          *  way than on this connection's input, such as in the body of an
+          *  HTTP request, with the same methods, limits and handler threads.
+          *
+          *  Must be called on the thread that runs exec(), or that created the
+          *  connection if exec() is never called.  Waits while max_in_flight
+          *  requests are being handled.
+          *
+          *  @param on_reply - called once with the reply, which is not sent on
+          *         the connection's output
+          */
+         void handle_message( const variant& msg, const message_handler& on_reply );
          //@}
 
+         /**
+          * @name publish and subscribe
+          *
+          * These must be called on the thread that runs exec().
+          */
+         ///@{
+         /** lets the remote side subscribe to topic */
+         void add_topic( const fc::string& topic, const topic_config& c = topic_config() );
+         /** queues msg for every subscriber to topic and sends what their credit allows */
+         void publish( const fc::string& topic, const variant& msg );
+
+         /**
+          *  Subscribes to a topic that the remote side added.  on_event is called
+          *  with each message in order, one at a time, on the thread that runs
+          *  exec().
+          *
+          *  @param window - messages the remote side may send ahead of on_event,
+          *         credit is granted as on_event returns
+          *  @return the subscription, once the remote side has accepted it
+          */
+         future<uint64_t> subscribe( const fc::string& topic, const event_handler& on_event, uint32_t window = 64 );
+         void unsubscribe( uint64_t subscription );
+         ///@}
+
          /**
           * @name client interface
           */
@@ -64,6 +239,18 @@ namespace fc { namespace rpc  {
 
          future<variant> async_call( const fc::string& method );
 
+         /**
+          *  Sends params as they are, rather than as an array or object.
+          *
+          *  @param on_reply - installed before the call is sent, so it sees the
+          *         reply however quickly it arrives
+          *  @param deadline - the call fails with timeout_exception if there is
+          *         no reply by then, maximum for the configured call_timeout
+          */
+         future<variant> async_generic_call( const fc::string& method, variant params,
+                                             reply_handler on_reply = reply_handler(),
+                                             const fc::time_point& deadline = fc::time_point::maximum() );
+
          future<variant> async_call( const fc::string& method, 
                                      const variant& a1 );
 
@@ -76,6 +263,17 @@ namespace fc { namespace rpc  {
                                      const variant& a2, 
                                      const variant& a3 );
 
+         /**
+          *  Sends the calls as one JSON-RPC batch, which the remote side may
+          *  handle concurrently and answer with a single reply.
+          *
+          *  @param deadline - applies to every call, maximum for the configured call_timeout
+          *  @return the futures for each call, in the same order
+          */
+         std::vector<future<variant>> async_batch( const std::vector<batch_call>& calls,
+                                                   const fc::time_point& deadline = fc::time_point::maximum() );
+
+         /// the timeout becomes the deadline of the call, which is then abandoned on both sides
          template<typename Result>
          Result call( const fc::string& method, 
                                const variant& a1, 
@@ -83,7 +281,8 @@ namespace fc { namespace rpc  {
                                const variant& a3,
                                microseconds timeout = microseconds::maximum())
          {
-            return async_call( method, a1, a2, a3 ).wait(timeout).as<Result>();
+            return async_generic_call( method, variant( variants{ a1, a2, a3 } ), reply_handler(),
+                                       deadline_after( timeout ) ).wait(timeout).as<Result>();
          }
 
          template<typename Result>
@@ -92,7 +291,8 @@ namespace fc { namespace rpc  {
                                const variant& a2, 
                                microseconds timeout = microseconds::maximum())
          {
-            return async_call( method, a1, a2 ).wait(timeout).as<Result>();
+            return async_generic_call( method, variant( variants{ a1, a2 } ), reply_handler(),
+                                       deadline_after( timeout ) ).wait(timeout).as<Result>();
          }
 
          template<typename Result>
@@ -100,7 +300,8 @@ namespace fc { namespace rpc  {
                                const variant& a1, 
                                microseconds timeout = microseconds::maximum())
          {
-            return async_call( method, a1 ).wait(timeout).as<Result>();
+            return async_generic_call( method, variant( variants{ a1 } ), reply_handler(),
+                                       deadline_after( timeout ) ).wait(timeout).as<Result>();
          }
 
          template<typename Result>
@@ -108,21 +309,24 @@ namespace fc { namespace rpc  {
                                variant_object a1, 
                                microseconds timeout = microseconds::maximum())
          {
-            return async_call( method, fc::move(a1) ).wait(timeout).as<Result>();
+            return async_generic_call( method, variant( fc::move(a1) ), reply_handler(),
+                                       deadline_after( timeout ) ).wait(timeout).as<Result>();
          }
          template<typename Result>
          Result call( const fc::string& method, 
                                mutable_variant_object a1, 
                                microseconds timeout = microseconds::maximum())
          {
-            return async_call( method, variant_object( fc::move(a1) ) ).wait(timeout).as<Result>();
+            return async_generic_call( method, variant( variant_object( fc::move(a1) ) ), reply_handler(),
+                                       deadline_after( timeout ) ).wait(timeout).as<Result>();
          }
 
 
          template<typename Result>
          Result call( const fc::string& method, microseconds timeout = microseconds::maximum() )
          {
-            return async_call( method ).wait(timeout).as<Result>();
+            return async_generic_call( method, variant(), reply_handler(),
+                                       deadline_after( timeout ) ).wait(timeout).as<Result>();
          }
 
          /// Sending in a variant_object will be issued as named parameters
@@ -130,6 +334,12 @@ namespace fc { namespace rpc  {
          ///@}
          
       private:
+         static fc::time_point deadline_after( const microseconds& timeout )
+         {
+            if( timeout == microseconds::maximum() ) return fc::time_point::maximum();
+            return fc::time_point::now() + timeout;
+         }
+
          std::unique_ptr<detail::json_connection_impl> my;
    };
    typedef std::shared_ptr<json_connection> json_connection_ptr;
@@ -0,0 +1,203 @@
+#pragma once
+#include <fc/rpc/json_connection.hpp>
+#include <fc/ptr.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/io/raw_variant.hpp>
+#include <fc/reflect/variant.hpp>
+#include <tuple>
+#include <type_traits>
+
+namespace fc { namespace rpc {
+
+  namespace detail {
+    template<size_t... I> struct indices {};
+    template<size_t N, size_t... I> struct make_indices : make_indices<N-1, N-1, I...> {};
+    template<size_t... I> struct make_indices<0, I...> { typedef indices<I...> type; };
+
+    /** packs the values one after another into a string */
+    template<typename... Args>
+    fc::string pack_args( const Args&... args ) {
+       fc::datastream<size_t> ps;
+       int sizes[] = { 0, (fc::raw::pack( ps, args ), 0)... };
+       (void)sizes;
+
+       fc::string packed( ps.tellp(), '\0' );
+       if( packed.size() ) {
+         fc::datastream<char*> ds( &packed[0], packed.size() );
+         int packs[] = { 0, (fc::raw::pack( ds, args ), 0)... };
+         (void)packs;
+       }
+       return packed;
+    }
+
+    template<typename Tuple, size_t... I>
+    void unpack_args( const fc::string& packed, Tuple& args, indices<I...> ) {
+       fc::datastream<const char*> ds( packed.data(), packed.size() );
+       // braced initializers are evaluated in order, so the args are read in order
+       int unpacks[] = { 0, (fc::raw::unpack( ds, std::get<I>(args) ), 0)... };
+       (void)unpacks;
+    }
+
+    template<typename Tuple, size_t... I>
+    void args_from_variants( const variants& params, Tuple& args, indices<I...> ) {
+       FC_ASSERT( params.size() == sizeof...(I), "expected ${n} params, got ${p}", ("n",sizeof...(I))("p",params.size()) );
+       int converts[] = { 0, (fc::from_variant( params[I], std::get<I>(args) ), 0)... };
+       (void)converts;
+    }
+
+    /** calls the member with the decoded args and encodes its result the way the args were encoded */
+    template<typename R>
+    struct invoke_member {
+       template<typename P, typename Member, typename Tuple, size_t... I>
+       static variant call( const P& self, Member m, Tuple& args, indices<I...>, bool packed ) {
+          R r = ((*self).*m)( std::get<I>(args)... );
+          if( packed ) return variant( pack_args( r ) );
+          return variant( r );
+       }
+    };
+    template<>
+    struct invoke_member<void> {
+       template<typename P, typename Member, typename Tuple, size_t... I>
+       static variant call( const P& self, Member m, Tuple& args, indices<I...>, bool ) {
+          ((*self).*m)( std::get<I>(args)... );
+          return variant();
+       }
+    };
+
+    template<typename R, typename P, typename Member, typename... Args>
+    json_connection::generic_method make_generic_method( const P& self, Member m ) {
+       return [=]( const variant& params ) -> variant {
+          typedef std::tuple<typename std::decay<Args>::type...>      arg_tuple;
+          typedef typename make_indices<sizeof...(Args)>::type       arg_indices;
+
+          arg_tuple args;
+          bool packed = params.is_string();
+          if( packed )
+             unpack_args( params.get_string(), args, arg_indices() );
+          else if( params.is_null() )
+             args_from_variants( variants(), args, arg_indices() );
+          else
+             args_from_variants( params.get_array(), args, arg_indices() );
+          return invoke_member<R>::call( self, m, args, arg_indices(), packed );
+       };
+    }
+
+    template<typename P>
+    struct add_interface_visitor {
+       add_interface_visitor( json_connection& c, const P& self ):_con(c),_self(self){}
+
+       template<typename Function, typename R, typename C, typename... Args>
+       void operator()( const char* name, Function&, R (C::*m)(Args...) )const {
+         _con.add_generic_method( name, make_generic_method<R,P,R (C::*)(Args...),Args...>( _self, m ) );
+       }
+       template<typename Function, typename R, typename C, typename... Args>
+       void operator()( const char* name, Function&, R (C::*m)(Args...)const )const {
+         _con.add_generic_method( name, make_generic_method<R,P,R (C::*)(Args...)const,Args...>( _self, m ) );
+       }
+
+       json_connection& _con;
+       P                _self;
+    };
+
+    template<typename R>
+    struct set_reply {
+       static void set( promise<R>& p, const variant& r, bool packed ) {
+          if( packed ) {
+            const fc::string& s = r.get_string();
+            p.set_value( fc::raw::unpack<R>( s.data(), uint32_t(s.size()) ) );
+          }
+          else
+            p.set_value( r.as<R>() );
+       }
+    };
+    template<>
+    struct set_reply<void> {
+       static void set( promise<void>& p, const variant&, bool ) { p.set_value(); }
+    };
+
+    template<typename R, typename... Args>
+    fc::future<R> remote_call( const json_connection_ptr& con, const fc::string& method, const Args&... args ) {
+       typename fc::promise<R>::ptr prom( new fc::promise<R>( "fc::rpc::remote_call" ) );
+       bool packed = con->get_format() == json_connection::binary_format;
+       auto on_reply = [=]( const variant& r, const fc::exception_ptr& e ) {
+          if( e ) {
+            prom->set_exception( e );
+            return;
+          }
+          try {
+            set_reply<R>::set( *prom, r, packed );
+          } catch ( const fc::exception& ex ) {
+            prom->set_exception( ex.dynamic_copy_exception() );
+          }
+       };
+       if( packed ) con->async_generic_call( method, variant( pack_args( args... ) ), on_reply );
+       else         con->async_generic_call( method, variant( variants{ variant(args)... } ), on_reply );
+       return prom;
+    }
+
+    /** turns each member of an interface into a call over a json_connection */
+    struct remote_member {
+       template<typename R, typename C, typename P, typename... Args>
+       static std::function<fc::future<R>(Args...)> functor( P&& c, R (C::*mem_func)(Args...), const char* name = "" ) {
+          json_connection_ptr con(c);
+          fc::string          method(name);
+          return [=]( Args... args ) -> fc::future<R> { return remote_call<R>( con, method, args... ); };
+       }
+       template<typename R, typename C, typename P, typename... Args>
+       static std::function<fc::future<R>(Args...)> functor( P&& c, R (C::*mem_func)(Args...)const, const char* name = "" ) {
+          json_connection_ptr con(c);
+          fc::string          method(name);
+          return [=]( Args... args ) -> fc::future<R> { return remote_call<R>( con, method, args... ); };
+       }
+    };
+
+    struct remote_vtable_visitor {
+       remote_vtable_visitor( const json_connection_ptr& c ):_con(c){}
+
+       template<typename Function, typename MemberPtr>
+       void operator()( const char* name, Function& memb, MemberPtr m )const {
+         memb = remote_member::functor( _con, m, name );
+       }
+       json_connection_ptr _con;
+    };
+  } // namespace detail
+
+  /**
+   *  Calls the methods of an interface declared with FC_STUB on the remote
+   *  side of a connection, each returning a future of its result.
+   *
+   *  When the connection sends binary_format the arguments and result are
+   *  fc::raw packed straight from and into their types, otherwise they are
+   *  sent as variants like any other call.
+   *
+   *  @code
+   *    fc::rpc::remote<calculator> calc( con );
+   *    int sum = calc->add( 1, 2 ).wait();
+   *  @endcode
+   */
+  template<typename Interface>
+  class remote : public fc::ptr<Interface, detail::remote_member> {
+    public:
+      remote(){}
+
+      remote( const json_connection_ptr& c ) {
+         this->_vtable.reset( new fc::detail::vtable<Interface,detail::remote_member>() );
+         this->_vtable->template visit_other<Interface>( detail::remote_vtable_visitor( c ) );
+      }
+  };
+
+  /**
+   *  Adds a method for every member of Interface, which must be declared with
+   *  FC_STUB, calling the same member of self.  Calls from a remote<Interface>
+   *  over binary_format are unpacked straight into the parameter types.
+   *
+   *  @param self - a pointer, or a shared pointer which the methods keep alive
+   */
+  template<typename Interface, typename P>
+  void add_interface( json_connection& c, const P& self ) {
+     typedef typename std::remove_reference<decltype(*self)>::type impl_type;
+     fc::detail::vtable<Interface> vt;
+     vt.template visit_other<impl_type>( detail::add_interface_visitor<P>( c, self ) );
+  }
+
+} } // fc::rpc
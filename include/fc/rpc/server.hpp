@@ -0,0 +1,79 @@
+#pragma once
+#include <fc/rpc/json_connection.hpp>
+#include <functional>
+#include <memory>
+
+namespace fc { namespace rpc {
+
+  /**
+   *  Serves one set of JSON-RPC methods to clients connecting over raw TCP,
+   *  where each connection is a json_connection, and to clients sending the
+   *  requests as the body of HTTP POST requests.
+   *
+   *  TCP connections are accepted on every thread of the server's pool and
+   *  handled on the thread that accepted them.  HTTP requests are read on the
+   *  first thread and handed to each thread in turn.  Unless the connection
+   *  config has handler_threads, methods run on these threads, so a server
+   *  with several threads uses several cores.
+   *
+   *  @code
+   *    fc::rpc::server srv;
+   *    srv.add_method( "echo", json_connection::method( [](const variants& a){ return a[0]; } ) );
+   *    srv.listen_tcp( 8090 );
+   *    srv.listen_http( 8080 );
+   *  @endcode
+   */
+  class server
+  {
+    public:
+      struct config
+      {
+         config():threads(1){}
+
+         /** threads created to handle connections, 0 uses the thread that created the server */
+         uint32_t                threads;
+         /** used for every connection */
+         json_connection::config connection;
+      };
+      /** sets up each new connection, for example with add_interface() */
+      typedef std::function<void(json_connection&)> connection_handler;
+
+      server( const config& c = config() );
+      ~server();
+
+      /**
+       *  @name method registry
+       *
+       *  Methods apply to TCP connections made after they are added, and to
+       *  every HTTP request handled after they are added.
+       */
+      ///@{
+      void add_method( const fc::string& name, json_connection::method m, uint32_t max_concurrency = 0 );
+      void add_method( const fc::string& name, json_connection::named_param_method m, uint32_t max_concurrency = 0 );
+      void add_generic_method( const fc::string& name, json_connection::generic_method m, uint32_t max_concurrency = 0 );
+      /** called for every connection, in the order it was added among the methods */
+      void on_connection( const connection_handler& h );
+      ///@}
+
+      /** lets TCP clients subscribe to topic, @see json_connection::subscribe() */
+      void add_topic( const fc::string& topic, const json_connection::topic_config& c = json_connection::topic_config() );
+      /**
+       *  Publishes msg on every TCP connection, each on its own thread.  Never
+       *  waits, a subscriber out of credit only fills its own queue.
+       */
+      void publish( const fc::string& topic, const variant& msg );
+
+      /** accepts connections that send a JSON-RPC message per line, or binary messages */
+      void listen_tcp( uint16_t port );
+      /** answers POST requests with a JSON-RPC message or batch as the body */
+      void listen_http( uint16_t port );
+
+      /** stops listening and closes every TCP connection */
+      void close();
+
+    private:
+      class impl;
+      std::unique_ptr<impl> my;
+  };
+
+} } // fc::rpc
@@ -67,6 +67,8 @@ namespace fc {
       void _set_value(const void* v);
 
       void _on_complete( detail::completion_handler* c );
+      /** returns a ready promise to its initial state so that it may be waited on again */
+      void _reset();
       ~promise_base();
 
     private:
@@ -6,6 +6,7 @@
 namespace fc {
   class time_point;
   class microseconds;
+  namespace asio { void integrate_reactor(); }
 
   class thread {
     public:
@@ -123,6 +124,7 @@ namespace fc {
       friend void usleep(const microseconds&);
       friend void sleep_until(const time_point&);
       friend void exec();
+      friend void asio::integrate_reactor();
       friend int wait_any( std::vector<promise_base::ptr>&& v, const microseconds& );
       friend int wait_any_until( std::vector<promise_base::ptr>&& v, const time_point& tp );
       void wait_until( promise_base::ptr && v, const time_point& tp );
@@ -1,33 +1,56 @@
 #include <fc/asio.hpp>
 #include <fc/thread/thread.hpp>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <algorithm>
 #include <fc/log/logger.hpp>
+#include "thread/thread_d.hpp"
 
 namespace fc {
   namespace asio {
     namespace detail {
+        static fc::exception_ptr error_to_exception( const boost::system::error_code& ec ) {
+            if( ec == boost::asio::error::operation_aborted )
+            {
+              return fc::exception_ptr( new fc::canceled_exception( 
+                      FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) );
+            }
+            else if( ec == boost::asio::error::eof  )
+            {
+              return fc::exception_ptr( new fc::eof_exception( 
+                      FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) );
+            }
+            else
+            {
+             // elog( "${message} ", ("message", boost::system::system_error(ec).what()));
+              return fc::exception_ptr( new fc::exception( 
+                      FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) );
+            }
+        }
+
+        void throw_error( const boost::system::error_code& ec ) {
+            error_to_exception( ec )->dynamic_rethrow_exception();
+        }
+
+      #ifdef _MSC_VER
+        static __declspec(thread) uint32_t sync_completions = 0;
+      #else
+        static __thread uint32_t sync_completions = 0;
+      #endif
+
+        void sync_completed() {
+            ++sync_completions;
+        }
+
+        void yield_if_sync_limit() {
+            if( sync_completions < sync_completion_limit ) return;
+            sync_completions = 0;
+            fc::yield();
+        }
+
         void read_write_handler( const promise<size_t>::ptr& p, const boost::system::error_code& ec, size_t bytes_transferred ) {
             if( !ec ) p->set_value(bytes_transferred);
-            else {
-            //   elog( "%s", boost::system::system_error(ec).what() );
-            //   p->set_exception( fc::copy_exception( boost::system::system_error(ec) ) );
-                if( ec == boost::asio::error::operation_aborted )
-                {
-                  p->set_exception( fc::exception_ptr( new fc::canceled_exception( 
-                          FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) ) );
-                }
-                else if( ec == boost::asio::error::eof  )
-                {
-                  p->set_exception( fc::exception_ptr( new fc::eof_exception( 
-                          FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) ) );
-                }
-                else
-                {
-                 // elog( "${message} ", ("message", boost::system::system_error(ec).what()));
-                  p->set_exception( fc::exception_ptr( new fc::exception( 
-                          FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) ) );
-                }
-            }
+            else p->set_exception( error_to_exception( ec ) );
         }
         void read_write_handler_ec( promise<size_t>* p, boost::system::error_code* oec, const boost::system::error_code& ec, size_t bytes_transferred ) {
             p->set_value(bytes_transferred);
@@ -36,25 +59,7 @@ namespace fc {
         void error_handler( const promise<void>::ptr& p, 
                               const boost::system::error_code& ec ) {
             if( !ec ) p->set_value();
-            else
-            {
-                if( ec == boost::asio::error::operation_aborted )
-                {
-                  p->set_exception( fc::exception_ptr( new fc::canceled_exception( 
-                          FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) ) );
-                }
-                else if( ec == boost::asio::error::eof  )
-                {
-                  p->set_exception( fc::exception_ptr( new fc::eof_exception( 
-                          FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) ) );
-                }
-                else
-                {
-                 // elog( "${message} ", ("message", boost::system::system_error(ec).what()));
-                  p->set_exception( fc::exception_ptr( new fc::exception( 
-                          FC_LOG_MESSAGE( error, "${message} ", ("message", boost::system::system_error(ec).what())) ) ) );
-                }
-            }
+            else p->set_exception( error_to_exception( ec ) );
         }
 
         void error_handler_ec( promise<boost::system::error_code>* p, 
@@ -84,23 +89,94 @@ namespace fc {
             }
         }
     }
+    namespace detail {
+        static boost::asio::io_service*& bound_io_service() {
+          #ifdef _MSC_VER
+             static __declspec(thread) boost::asio::io_service* s = NULL;
+          #else
+             static __thread boost::asio::io_service* s = NULL;
+          #endif
+          return s;
+        }
+
+        static uint32_t           reactor_count_setting = 1;
+        static boost::atomic<bool> reactor_pool_started(false);
+
+        /**
+         *  The io_services and the threads that run them, these live until
+         *  the process exits.
+         */
+        class reactor_pool
+        {
+           public:
+             reactor_pool( uint32_t n )
+             :_next(0)
+             {
+                reactor_pool_started = true;
+                for( uint32_t i = 0; i < n; ++i )
+                {
+                   auto io = new boost::asio::io_service();
+                   _services.push_back( io );
+                   _work.push_back( new boost::asio::io_service::work(*io) );
+                   _threads.push_back( new boost::thread( [=]
+                          {
+                            try {
+                              fc::thread::current().set_name( n == 1 ? fc::string("asio") : "asio" + fc::to_string(uint64_t(i)) );
+                              // anything created by a completion handler stays on this reactor
+                              bound_io_service() = io;
+                              io->run();
+                            }
+                            catch(...)
+                            {
+                              elog( "unexpected asio exception" );
+                            }
+                          } ) );
+                }
+             }
+
+             boost::asio::io_service& next()
+             {
+                return *_services[ _next++ % _services.size() ];
+             }
+
+           private:
+             boost::atomic<uint32_t>                          _next;
+             std::vector<boost::asio::io_service*>            _services;
+             std::vector<boost::asio::io_service::work*>      _work;
+             std::vector<boost::thread*>                      _threads;
+        };
+
+        static reactor_pool& get_reactor_pool() {
+           static reactor_pool* pool = new reactor_pool( std::max<uint32_t>( reactor_count_setting, 1 ) );
+           return *pool;
+        }
+    }
+
     boost::asio::io_service& default_io_service(bool cleanup) {
-        static boost::asio::io_service       io;
-        static boost::asio::io_service::work the_work(io);
-        static boost::thread                 io_t([=] 
-               { 
-                 try { 
-                   fc::thread::current().set_name("asio");  
-                   io.run(); 
-                 }
-                 catch(...)
-                 {
-                   elog( "unexpected asio exception" );
-                 }
-               } 
-               );
-
-        return io;
+        auto& io = detail::bound_io_service();
+        if( !io ) io = &detail::get_reactor_pool().next();
+        return *io;
+    }
+
+    void integrate_reactor() {
+        auto& io = detail::bound_io_service();
+        thread_d* t = fc::thread::current().my;
+        if( t->io ) return;
+        FC_ASSERT( !io, "integrate_reactor() must be called before the thread uses default_io_service()" );
+
+        t->io.reset( new boost::asio::io_service() );
+        t->io_work.reset( new boost::asio::io_service::work( *t->io ) );
+        t->io_timer.reset( new boost::asio::deadline_timer( *t->io ) );
+        io = t->io.get();
+    }
+
+    void set_reactor_count( uint32_t n ) {
+        FC_ASSERT( !detail::reactor_pool_started, "the reactor count must be set before the first call to default_io_service()" );
+        detail::reactor_count_setting = n;
+    }
+
+    uint32_t reactor_count() {
+        return std::max<uint32_t>( detail::reactor_count_setting, 1 );
     }
 
     namespace tcp {
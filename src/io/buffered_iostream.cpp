@@ -1,7 +1,8 @@
 #include <fc/io/buffered_iostream.hpp>
 #include <fc/exception/exception.hpp>
-#include <boost/asio/streambuf.hpp>
-#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string.h>
 
 #include <fc/log/logger.hpp>
 
@@ -9,20 +10,107 @@ namespace fc
 {
     namespace detail
     {
+       /**
+        *  Fixed capacity ring buffer, _read and _write only ever increase and are
+        *  reduced modulo the capacity when indexing.
+        */
+       class ring_buffer
+       {
+          public:
+             ring_buffer( size_t capacity )
+             :_data( std::max<size_t>( capacity, 1 ) ),_read(0),_write(0){}
+
+             size_t capacity()const { return _data.size();            }
+             size_t size()const     { return size_t(_write - _read);  }
+             size_t free()const     { return capacity() - size();     }
+
+             /** largest contiguous range of data that can be read */
+             const_buffer read_span()const
+             {
+                size_t start = size_t(_read % capacity());
+                return const_buffer( _data.data() + start, std::min( size(), capacity() - start ) );
+             }
+
+             /** all of the buffered data as at most two ranges, returns the number of ranges */
+             size_t read_spans( const_buffer (&s)[2] )const
+             {
+                s[0] = read_span();
+                s[1] = const_buffer( _data.data(), size() - s[0].size );
+                return s[1].size ? 2 : (s[0].size ? 1 : 0);
+             }
+
+             /** largest contiguous range of free space, commit() after writing to it */
+             char* write_span( size_t& len )
+             {
+                if( size() == 0 ) _read = _write = 0; // maximize the contiguous space
+                size_t start = size_t(_write % capacity());
+                len = std::min( free(), capacity() - start );
+                return _data.data() + start;
+             }
+
+             void   commit( size_t n )  { _write += n; }
+             void   consume( size_t n ) { _read  += n; }
+
+             size_t read( char* buf, size_t len )
+             {
+                size_t total = 0;
+                while( total < len && size() )
+                {
+                   const_buffer s = read_span();
+                   size_t n = std::min( len - total, s.size );
+                   memcpy( buf + total, s.data, n );
+                   consume( n );
+                   total += n;
+                }
+                return total;
+             }
+
+             size_t write( const char* buf, size_t len )
+             {
+                size_t total = 0;
+                while( total < len && free() )
+                {
+                   size_t avail = 0;
+                   char*  dst   = write_span( avail );
+                   size_t n     = std::min( len - total, avail );
+                   memcpy( dst, buf + total, n );
+                   commit( n );
+                   total += n;
+                }
+                return total;
+             }
+
+          private:
+             std::vector<char> _data;
+             uint64_t          _read;
+             uint64_t          _write;
+       };
+
        class buffered_istream_impl
        {
           public:
-             buffered_istream_impl( istream_ptr is )
-             :_istr(fc::move(is)){}
+             buffered_istream_impl( istream_ptr is, size_t bufsize )
+             :_istr(fc::move(is)),_rdbuf(bufsize),_total_read(0){}
+
+             /** reads from the underlying stream into the free space of the buffer */
+             void fill()
+             {
+                size_t avail = 0;
+                char*  dst   = _rdbuf.write_span( avail );
+                size_t n     = _istr->readsome( dst, avail );
+                _rdbuf.commit( n );
+                _total_read += n;
+             }
 
-             istream_ptr            _istr;
-             boost::asio::streambuf _rdbuf;
+             istream_ptr   _istr;
+             ring_buffer   _rdbuf;
+             /** everything read from _istr, including what is still buffered */
+             uint64_t      _total_read;
        };
-       static const size_t minimum_read_size = 1024;
     }
 
-    buffered_istream::buffered_istream( istream_ptr is )
-    :my( new detail::buffered_istream_impl( fc::move(is) ) )
+    buffered_istream::buffered_istream( istream_ptr is, size_t bufsize )
+    :my( new detail::buffered_istream_impl( fc::move(is), bufsize ) )
     {
        FC_ASSERT( my->_istr != nullptr, " this shouldn't be null" );
     }
@@ -40,47 +128,59 @@ namespace fc
 
     size_t buffered_istream::readsome( char* buf, size_t len )
     {
-        size_t bytes_from_rdbuf = static_cast<size_t>(my->_rdbuf.sgetn(buf, len));
-        if (bytes_from_rdbuf)
-           return bytes_from_rdbuf;
+        if( my->_rdbuf.size() )
+           return my->_rdbuf.read( buf, len );
 
+        // large reads go straight to the caller, there is nothing to gain by buffering
+        if( len >= my->_rdbuf.capacity() )
+        {
+           size_t n = my->_istr->readsome(buf,len);
+           my->_total_read += n;
+           return n;
+        }
 
-        if( len > detail::minimum_read_size ) 
-           return my->_istr->readsome(buf,len);
+        my->fill();
+        return my->_rdbuf.read( buf, len );
+    }
 
-        char tmp[detail::minimum_read_size];
-        size_t bytes_read = my->_istr->readsome( tmp, detail::minimum_read_size );
+    char  buffered_istream::peek()const
+    {
+       if( !my->_rdbuf.size() )
+          my->fill();
 
-        size_t bytes_to_deliver_immediately = std::min<size_t>(bytes_read,len);
+       if( my->_rdbuf.size() )
+          return *my->_rdbuf.read_span().data;
 
-        memcpy( buf, tmp, bytes_to_deliver_immediately );
-        
+       FC_THROW_EXCEPTION( assert_exception,
+          "at least one byte should be available, or eof should have been thrown" );
+    }
 
-        if( bytes_read > len )
-        {
-           my->_rdbuf.sputn( tmp + len, bytes_read - len );
-        }
+    char  buffered_istream::get()
+    {
+       if( !my->_rdbuf.size() )
+          my->fill();
 
-        return bytes_to_deliver_immediately;
+       char c = *my->_rdbuf.read_span().data;
+       my->_rdbuf.consume(1);
+       return c;
     }
 
-    char  buffered_istream::peek()const
+    const_buffer buffered_istream::peek_span()const
     {
-       if( my->_rdbuf.size() )
-       {
-          return my->_rdbuf.sgetc();
-       }
+       if( !my->_rdbuf.size() )
+          my->fill();
+       return my->_rdbuf.read_span();
+    }
 
-       char tmp[detail::minimum_read_size];
-       size_t bytes_read = my->_istr->readsome( tmp, detail::minimum_read_size );
-       my->_rdbuf.sputn( tmp, bytes_read );
+    void buffered_istream::consume( size_t n )
+    {
+       FC_ASSERT( n <= my->_rdbuf.read_span().size );
+       my->_rdbuf.consume( n );
+    }
 
-       if( my->_rdbuf.size() )
-       {
-          return my->_rdbuf.sgetc();
-       }
-       FC_THROW_EXCEPTION( assert_exception, 
-          "at least one byte should be available, or eof should have been thrown" );
+    uint64_t buffered_istream::bytes_read()const
+    {
+       return my->_total_read - my->_rdbuf.size();
     }
 
 
@@ -89,16 +189,25 @@ namespace fc
        class buffered_ostream_impl
        {
           public:
-             buffered_ostream_impl( ostream_ptr os )
-             :_ostr(fc::move(os)){}
+             buffered_ostream_impl( ostream_ptr os, size_t bufsize )
+             :_ostr(fc::move(os)),_wrbuf(bufsize){}
+
+             /** writes everything buffered to the underlying stream without copying it */
+             void drain()
+             {
+                const_buffer spans[2];
+                size_t       buffered = _wrbuf.size();
+                _ostr->writev( spans, _wrbuf.read_spans( spans ) );
+                _wrbuf.consume( buffered );
+             }
 
-             ostream_ptr            _ostr;
-             boost::asio::streambuf _rdbuf;
+             ostream_ptr   _ostr;
+             ring_buffer   _wrbuf;
        };
     }
 
     buffered_ostream::buffered_ostream( ostream_ptr os, size_t bufsize )
-    :my( new detail::buffered_ostream_impl( fc::move(os) ) )
+    :my( new detail::buffered_ostream_impl( fc::move(os), bufsize ) )
     {
     }
 
@@ -115,16 +224,44 @@ namespace fc
 
     size_t buffered_ostream::writesome( const char* buf, size_t len )
     {
-        size_t written = static_cast<size_t>(my->_rdbuf.sputn( buf, len ));
-        if( written < len ) { flush(); }
-        return written + static_cast<size_t>(my->_rdbuf.sputn( buf+written, len-written ));
+        // writes that would not fit are sent on without a copy
+        if( !my->_wrbuf.size() && len >= my->_wrbuf.capacity() )
+        {
+           my->_ostr->write( buf, len );
+           return len;
+        }
+        if( !my->_wrbuf.free() )
+           my->drain();
+        return my->_wrbuf.write( buf, len );
+    }
+
+    ostream& buffered_ostream::writev( const const_buffer* bufs, size_t n )
+    {
+        size_t total = 0;
+        for( size_t i = 0; i < n; ++i ) total += bufs[i].size;
+
+        if( total <= my->_wrbuf.free() )
+        {
+           for( size_t i = 0; i < n; ++i )
+              my->_wrbuf.write( bufs[i].data, bufs[i].size );
+           return *this;
+        }
+
+        // send the buffered data and bufs together rather than draining first
+        std::vector<const_buffer> seq;
+        seq.reserve( n + 2 );
+        size_t buffered = my->_wrbuf.size();
+        const_buffer spans[2];
+        seq.insert( seq.end(), spans, spans + my->_wrbuf.read_spans( spans ) );
+        seq.insert( seq.end(), bufs, bufs + n );
+        my->_ostr->writev( seq.data(), seq.size() );
+        my->_wrbuf.consume( buffered );
+        return *this;
     }
 
     void  buffered_ostream::flush()
     {
-        char buffer[2048];    
-        while( size_t bytes_from_rdbuf = static_cast<size_t>(my->_rdbuf.sgetn(buffer,sizeof(buffer))) )
-           my->_ostr->write( buffer, bytes_from_rdbuf );
+        my->drain();
         my->_ostr->flush();
     }
 
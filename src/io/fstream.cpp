@@ -1,82 +1,320 @@
 #include <fc/io/fstream.hpp>
 #include <fc/filesystem.hpp>
-#include <fstream>
 #include <fc/exception/exception.hpp>
 #include <fc/log/logger.hpp>
 
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <io.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace fc {
+   namespace detail
+   {
+      /** alignment required of buffers, offsets and sizes for O_DIRECT io */
+      static const size_t direct_io_alignment = 4096;
+
+#ifdef WIN32
+      inline int     fd_open( const char* f, int flags )   { return ::_open( f, flags | _O_BINARY, _S_IREAD | _S_IWRITE ); }
+      inline int64_t fd_read( int fd, char* b, size_t l )  { return ::_read( fd, b, unsigned(l) );         }
+      inline int64_t fd_write( int fd, const char* b, size_t l ) { return ::_write( fd, b, unsigned(l) ); }
+      inline int64_t fd_seek( int fd, int64_t p, int w )   { return ::_lseeki64( fd, p, w );               }
+      inline void    fd_close( int fd )                    { ::_close(fd);                                 }
+      inline char*   aligned_alloc( size_t s )             { return (char*)::_aligned_malloc( s, direct_io_alignment ); }
+      inline void    aligned_free( char* p )               { ::_aligned_free(p);                           }
+#else
+      inline int     fd_open( const char* f, int flags )   { return ::open( f, flags, 0644 );              }
+      inline int64_t fd_read( int fd, char* b, size_t l )  { return ::read( fd, b, l );                    }
+      inline int64_t fd_write( int fd, const char* b, size_t l ) { return ::write( fd, b, l );             }
+      inline int64_t fd_seek( int fd, int64_t p, int w )   { return ::lseek( fd, p, w );                   }
+      inline void    fd_close( int fd )                    { ::close(fd);                                  }
+      inline char*   aligned_alloc( size_t s )
+      {
+         void* p = nullptr;
+         if( posix_memalign( &p, direct_io_alignment, s ) != 0 ) throw std::bad_alloc();
+         return (char*)p;
+      }
+      inline void    aligned_free( char* p )               { free(p);                                      }
+#endif
+
+      /** buffer aligned for O_DIRECT, only allocated on first use */
+      class file_buffer
+      {
+         public:
+            file_buffer():_data(nullptr),_capacity(0){}
+            ~file_buffer() { reset(); }
+
+            char*  data()const     { return _data;     }
+            size_t capacity()const { return _capacity; }
+
+            void   reserve( size_t s )
+            {
+               reset();
+               s = (s + direct_io_alignment - 1) & ~(direct_io_alignment - 1);
+               _data     = aligned_alloc( s );
+               _capacity = s;
+            }
+            void   reset()
+            {
+               if( _data ) aligned_free( _data );
+               _data     = nullptr;
+               _capacity = 0;
+            }
+         private:
+            char*  _data;
+            size_t _capacity;
+      };
+   }
+
    class ofstream::impl : public fc::retainable {
       public:
-         std::ofstream ofs;
+         impl():fd(-1),bufsize(0),pos(0){}
+         ~impl()
+         {
+            try { close(); }
+            catch ( const fc::exception& e )
+            {
+               wlog( "error closing ${file}: ${e}", ("file",file)("e",e.to_detail_string()) );
+            }
+         }
+
+         void write_fd( const char* d, size_t len )
+         {
+            while( len )
+            {
+               int64_t w = detail::fd_write( fd, d, len );
+               if( w < 0 )
+               {
+                  if( errno == EINTR ) continue;
+                  FC_THROW( "error writing ${file}: ${error}", ("file",file)("error",strerror(errno)) );
+               }
+               d   += w;
+               len -= w;
+            }
+         }
+
+         void flush_buffer()
+         {
+            if( pos ) write_fd( buf.data(), pos );
+            pos = 0;
+         }
+
+         void close()
+         {
+            if( fd < 0 ) return;
+            int tmp = fd;
+            try { flush_buffer(); } catch ( ... ) { fd = -1; detail::fd_close(tmp); throw; }
+            fd = -1;
+            detail::fd_close(tmp);
+            buf.reset();
+         }
+
+         fc::path            file;
+         int                 fd;
+         size_t              bufsize;
+         size_t              pos;
+         detail::file_buffer buf;
    };
+
    class ifstream::impl : public fc::retainable {
       public:
-         std::ifstream ifs;
+         impl():fd(-1),bufsize(0),rpos(0),rend(0),skip(0),direct(false),at_eof(true){}
+         ~impl() { close(); }
+
+         /** refills the buffer, returns false at end of file */
+         bool fill()
+         {
+            rpos = rend = 0;
+            while( true )
+            {
+               int64_t r = detail::fd_read( fd, buf.data(), buf.capacity() );
+               if( r < 0 )
+               {
+                  if( errno == EINTR ) continue;
+                  FC_THROW( "error reading ${file}: ${error}", ("file",file)("error",strerror(errno)) );
+               }
+               rend = size_t(r);
+               break;
+            }
+            // an O_DIRECT seek lands on the aligned offset before the requested one
+            rpos = std::min( skip, rend );
+            skip = 0;
+            at_eof = rpos == rend;
+            return !at_eof;
+         }
+
+         void close()
+         {
+            if( fd >= 0 ) detail::fd_close(fd);
+            fd     = -1;
+            rpos   = rend = skip = 0;
+            at_eof = true;
+            buf.reset();
+         }
+
+         fc::path            file;
+         int                 fd;
+         size_t              bufsize;
+         size_t              rpos;
+         size_t              rend;
+         size_t              skip;
+         bool                direct;
+         bool                at_eof;
+         detail::file_buffer buf;
    };
 
    ofstream::ofstream()
    :my( new impl() ){}
 
-   ofstream::ofstream( const fc::path& file, int m )
-   :my( new impl() ) { this->open( file, m ); }
+   ofstream::ofstream( const fc::path& file, int m, size_t bufsize )
+   :my( new impl() ) { this->open( file, m, bufsize ); }
    ofstream::~ofstream(){}
 
-   void ofstream::open( const fc::path& file, int m ) {
-      my->ofs.open( file.string().c_str(), std::ios::binary );
+   void ofstream::open( const fc::path& file, int m, size_t bufsize ) {
+      my->close();
+      my->file    = file;
+      my->bufsize = std::max( bufsize, size_t(1) );
+      my->fd      = detail::fd_open( file.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC );
+      if( my->fd < 0 )
+         FC_THROW( "unable to open ${file} for writing: ${error}", ("file",file)("error",strerror(errno)) );
    }
    size_t ofstream::writesome( const char* buf, size_t len ) {
-        my->ofs.write(buf,len);
-        return len;
+        // like std::ofstream, writes to a stream that failed to open are discarded
+        if( my->fd < 0 ) return len;
+        if( !my->buf.data() ) my->buf.reserve( my->bufsize );
+
+        // large writes skip the copy into the buffer
+        if( my->pos == 0 && len >= my->buf.capacity() ) {
+           my->write_fd( buf, len );
+           return len;
+        }
+        size_t n = std::min( len, my->buf.capacity() - my->pos );
+        memcpy( my->buf.data() + my->pos, buf, n );
+        my->pos += n;
+        if( my->pos == my->buf.capacity() )
+           my->flush_buffer();
+        return n;
    }
    void   ofstream::put( char c ) {
-        my->ofs.put(c);
+        write( &c, 1 );
    }
    void   ofstream::close() {
-        my->ofs.close();
+        my->close();
    }
    void   ofstream::flush() {
-        my->ofs.flush();
+        if( my->fd >= 0 ) my->flush_buffer();
    }
 
    ifstream::ifstream()
    :my(new impl()){}
-   ifstream::ifstream( const fc::path& file, int m )
+   ifstream::ifstream( const fc::path& file, int m, size_t bufsize )
    :my(new impl())
    {
-      this->open( file, m );
+      this->open( file, m, bufsize );
    }
    ifstream::~ifstream(){}
 
-   void ifstream::open( const fc::path& file, int m ) {
-      my->ifs.open( file.string().c_str(), std::ios::binary );
+   void ifstream::open( const fc::path& file, int m, size_t bufsize ) {
+      my->close();
+      my->file    = file;
+      my->direct  = false;
+
+      int flags = O_RDONLY;
+#ifdef O_DIRECT
+      if( m & direct ) flags |= O_DIRECT;
+#endif
+      my->fd = detail::fd_open( file.string().c_str(), flags );
+#ifdef O_DIRECT
+      // not every file system supports O_DIRECT, fall back to buffered io
+      if( my->fd < 0 && errno == EINVAL && (flags & O_DIRECT) )
+         my->fd = detail::fd_open( file.string().c_str(), O_RDONLY );
+      else
+         my->direct = (flags & O_DIRECT) != 0;
+#endif
+      if( my->fd < 0 ) {
+         if( errno == ENOENT )
+            FC_THROW_EXCEPTION( file_not_found_exception, "unable to open ${file}", ("file",file) );
+         FC_THROW( "unable to open ${file}: ${error}", ("file",file)("error",strerror(errno)) );
+      }
+#if defined(POSIX_FADV_SEQUENTIAL) && !defined(WIN32)
+      posix_fadvise( my->fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+      // there is no need for a buffer larger than the file
+      struct stat st;
+      if( fstat( my->fd, &st ) == 0 && st.st_size >= 0 )
+         bufsize = std::min( bufsize, size_t(st.st_size) + 1 );
+      my->bufsize = std::max( bufsize, size_t(1) );
+      my->at_eof  = false;
    }
    size_t ifstream::readsome( char* buf, size_t len ) {
-      auto s = size_t(my->ifs.readsome( buf, len ));
-      if( s <= 0 ) {
-         read( buf, 1 );
-         s = 1;
+      if( my->rpos == my->rend ) {
+         if( my->fd < 0 || my->at_eof ) FC_THROW_EXCEPTION( eof_exception, "" );
+         if( !my->buf.data() ) my->buf.reserve( my->bufsize );
+
+         // large reads go straight to the caller's buffer, O_DIRECT requires our aligned buffer
+         if( !my->direct && my->skip == 0 && len >= my->buf.capacity() ) {
+            while( true ) {
+               int64_t r = detail::fd_read( my->fd, buf, len );
+               if( r < 0 && errno == EINTR ) continue;
+               if( r < 0 )
+                  FC_THROW( "error reading ${file}: ${error}", ("file",my->file)("error",strerror(errno)) );
+               if( r == 0 ) {
+                  my->at_eof = true;
+                  FC_THROW_EXCEPTION( eof_exception, "" );
+               }
+               return size_t(r);
+            }
+         }
+         if( !my->fill() )
+            FC_THROW_EXCEPTION( eof_exception, "" );
       }
-      return s;
+      size_t n = std::min( len, my->rend - my->rpos );
+      memcpy( buf, my->buf.data() + my->rpos, n );
+      my->rpos += n;
+      return n;
    }
    ifstream& ifstream::read( char* buf, size_t len ) {
       if( eof() ) FC_THROW_EXCEPTION( eof_exception , "");
-      my->ifs.read(buf,len);
-      if (my->ifs.gcount() < int64_t(len))
-        FC_THROW_EXCEPTION( eof_exception , "");
+      istream::read( buf, len );
       return *this;
    }
    ifstream& ifstream::seekg( size_t p, seekdir d ) {
+      FC_ASSERT( my->fd >= 0, "file is not open" );
+      int64_t target = 0;
       switch( d ) {
-        case beg: my->ifs.seekg( p, std::ios_base::beg ); return *this;
-        case cur: my->ifs.seekg( p, std::ios_base::cur ); return *this;
-        case end: my->ifs.seekg( p, std::ios_base::end ); return *this;
+        case beg: target = int64_t(p); break;
+        // the file position is ahead of the logical position by the unread buffer
+        case cur: target = detail::fd_seek( my->fd, 0, SEEK_CUR ) - int64_t(my->rend - my->rpos) 
+                           + int64_t(my->skip) + int64_t(p); break;
+        case end: target = detail::fd_seek( my->fd, int64_t(p), SEEK_END ); break;
       }
+
+      int64_t aligned = target;
+      if( my->direct )
+         aligned = target & ~int64_t(detail::direct_io_alignment - 1);
+
+      if( target < 0 || detail::fd_seek( my->fd, aligned, SEEK_SET ) < 0 )
+         FC_THROW( "error seeking ${file}: ${error}", ("file",my->file)("error",strerror(errno)) );
+
+      my->rpos   = my->rend = 0;
+      my->skip   = size_t(target - aligned);
+      my->at_eof = false;
       return *this;
    }
-   void   ifstream::close() { return my->ifs.close(); }
+   void   ifstream::close() { my->close(); }
+
+   bool   ifstream::eof()const { return my->at_eof && my->rpos == my->rend; }
 
-   bool   ifstream::eof()const { return !my->ifs.good(); }
 
-  
-} // namespace fc 
+} // namespace fc
@@ -354,4 +354,11 @@ namespace fc {
       return *this;
   }
 
+  ostream& ostream::writev( const const_buffer* bufs, size_t n )
+  {
+      for( size_t i = 0; i < n; ++i )
+         write( bufs[i].data, bufs[i].size );
+      return *this;
+  }
+
 }
@@ -11,6 +11,9 @@ namespace fc
 {
    template<typename T>
    variant variant_from_stream( T& in );
+   void       skip_white_space( buffered_istream& in );
+   fc::string stringFromStream( buffered_istream& in );
+
    template<typename T>
    char parseEscape( T& in )
    {
@@ -95,6 +98,59 @@ namespace fc
                                           ("token", token.str() ) );
    }
 
+   /**
+    *  buffered_istream specializations that scan whole buffers instead of
+    *  peeking one character at a time.
+    */
+   void skip_white_space( buffered_istream& in )
+   {
+       while( true )
+       {
+          const_buffer s = in.peek_span();
+          size_t i = 0;
+          while( i < s.size && 
+                 (s.data[i] == ' ' || s.data[i] == '\t' || s.data[i] == '\n' || s.data[i] == '\r') )
+             ++i;
+          in.consume( i );
+          if( i < s.size ) return;
+       }
+   }
+
+   fc::string stringFromStream( buffered_istream& in )
+   {
+      fc::string token;
+      try 
+      {
+         char c = in.peek();
+
+         if( c != '"' )
+            FC_THROW_EXCEPTION( parse_error_exception, 
+                                            "Expected '\"' but read '${char}'", 
+                                            ("char", string(&c, (&c) + 1) ) );
+         in.get();
+         while( true )
+         {
+            const_buffer s = in.peek_span();
+            size_t i = 0;
+            while( i < s.size && s.data[i] != '"' && s.data[i] != '\\' )
+               ++i;
+            token.append( s.data, i );
+            in.consume( i );
+
+            if( i < s.size )
+            {
+               if( s.data[i] == '"' )
+               {
+                  in.get();
+                  return token;
+               }
+               token += parseEscape( in );
+            }
+         }
+       } FC_RETHROW_EXCEPTIONS( warn, "while parsing token '${token}'", 
+                                          ("token", token ) );
+   }
+
    template<typename T>
    variant_object objectFromStream( T& in )
    {
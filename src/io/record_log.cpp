@@ -0,0 +1,303 @@
+#include <fc/io/record_log.hpp>
+#include <fc/interprocess/file_mapping.hpp>
+#include <fc/exception/exception.hpp>
+#include <fc/log/logger.hpp>
+
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+uint32_t crc32cSlicingBy8(uint32_t crc, const void* data, size_t length);
+
+namespace fc
+{
+   namespace detail
+   {
+      static const uint32_t record_header_size = 2*sizeof(uint32_t);
+
+      /** covers the size as well, so an all zero header is not a valid empty record */
+      static uint32_t record_crc( const char* data, uint32_t len )
+      {
+         return ~crc32cSlicingBy8( crc32cSlicingBy8( 0xffffffff, &len, sizeof(len) ), data, len );
+      }
+
+      class record_log_impl
+      {
+         public:
+            record_log_impl()
+            :_fd(-1),_file_size(0),_unsynced(0),_recovered(0){}
+
+            ~record_log_impl()
+            {
+               try { close(); }
+               catch ( const fc::exception& e )
+               {
+                  wlog( "error closing record log: ${e}", ("e",e.to_detail_string()) );
+               }
+            }
+
+            void write_pending()
+            {
+               const char* pos = _pending.data();
+               size_t      len = _pending.size();
+               while( len )
+               {
+#ifdef WIN32
+                  int w = ::_write( _fd, pos, unsigned(len) );
+#else
+                  ssize_t w = ::write( _fd, pos, len );
+#endif
+                  if( w < 0 )
+                  {
+                     if( errno == EINTR ) continue;
+                     FC_THROW( "error writing record log ${file}: ${error}",
+                               ("file",_file)("error",strerror(errno)) );
+                  }
+                  pos += w;
+                  len -= w;
+               }
+               _file_size += _pending.size();
+               _pending.clear();
+            }
+
+            void sync()
+            {
+               if( _fd < 0 ) return;
+               write_pending();
+#ifdef WIN32
+               int r = ::_commit( _fd );
+#elif defined(__APPLE__)
+               int r = ::fsync( _fd );
+#else
+               int r = ::fdatasync( _fd );
+#endif
+               if( r != 0 )
+                  FC_THROW( "error syncing record log ${file}: ${error}",
+                            ("file",_file)("error",strerror(errno)) );
+               _unsynced = 0;
+            }
+
+            void close()
+            {
+               if( _fd < 0 ) return;
+               sync();
+#ifdef WIN32
+               ::_close(_fd);
+#else
+               ::close(_fd);
+#endif
+               _fd = -1;
+            }
+
+            fc::path           _file;
+            record_log::config _config;
+            int                _fd;
+            uint64_t           _file_size;
+            uint32_t           _unsynced;
+            uint64_t           _recovered;
+            std::vector<char>  _pending;
+      };
+
+      class record_log_reader_impl
+      {
+         public:
+            record_log_reader_impl()
+            :_data(nullptr),_size(0){}
+
+            fc::path                             _file;
+            std::unique_ptr<fc::file_mapping>    _file_mapping;
+            std::unique_ptr<fc::mapped_region>   _mapped_region;
+            const char*                          _data;
+            uint64_t                             _size;
+      };
+   }
+
+   record_log::record_log()
+   :my( new detail::record_log_impl() ){}
+
+   record_log::record_log( const fc::path& file, const config& c )
+   :my( new detail::record_log_impl() )
+   {
+      open( file, c );
+   }
+
+   record_log::record_log( record_log&& m )
+   :my( fc::move(m.my) ){}
+
+   record_log::~record_log(){}
+
+   record_log& record_log::operator=( record_log&& m )
+   {
+      my = fc::move(m.my);
+      return *this;
+   }
+
+   void record_log::open( const fc::path& file, const config& c )
+   { try {
+      close();
+      my->_file      = file;
+      my->_config    = c;
+      my->_recovered = 0;
+      my->_file_size = 0;
+
+      if( fc::exists( file ) )
+      {
+         uint64_t  fsize = fc::file_size( file );
+         my->_file_size  = record_log_reader( file ).valid_size();
+         if( my->_file_size < fsize )
+         {
+            my->_recovered = fsize - my->_file_size;
+            wlog( "truncating ${bytes} bytes after the last valid record of ${file}",
+                  ("bytes",my->_recovered)("file",file) );
+            fc::resize_file( file, my->_file_size );
+         }
+      }
+
+#ifdef WIN32
+      my->_fd = ::_open( file.string().c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE );
+#else
+      my->_fd = ::open( file.string().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644 );
+#endif
+      if( my->_fd < 0 )
+         FC_THROW( "unable to open record log: ${error}", ("error",strerror(errno)) );
+      my->_pending.reserve( my->_config.max_batch_bytes );
+   } FC_RETHROW_EXCEPTIONS( warn, "opening ${file}", ("file",file) ) }
+
+   uint64_t record_log::append( const char* data, uint32_t len )
+   {
+      FC_ASSERT( my->_fd >= 0, "record log is not open" );
+      FC_ASSERT( len > 0, "records may not be empty" );
+      uint64_t pos = size();
+
+      uint32_t header[2] = { len, detail::record_crc( data, len ) };
+      my->_pending.insert( my->_pending.end(), (const char*)header, (const char*)header + sizeof(header) );
+      my->_pending.insert( my->_pending.end(), data, data + len );
+
+      ++my->_unsynced;
+      if( my->_config.sync_interval && my->_unsynced >= my->_config.sync_interval )
+         my->sync();
+      else if( my->_pending.size() >= my->_config.max_batch_bytes )
+         my->write_pending();
+      return pos;
+   }
+
+   void record_log::flush()
+   {
+      if( my->_fd >= 0 ) my->write_pending();
+   }
+
+   void     record_log::sync()                 { my->sync();                                  }
+   void     record_log::close()                { my->close();                                 }
+   uint64_t record_log::size()const            { return my->_file_size + my->_pending.size(); }
+   uint64_t record_log::recovered_bytes()const { return my->_recovered;                       }
+
+
+   record_log_reader::iterator::iterator( const record_log_reader* r, uint64_t pos )
+   :_reader(r)
+   {
+      if( !_reader->read_record( pos, _view ) )
+         _view.offset = uint64_t(-1);
+   }
+
+   record_log_reader::iterator& record_log_reader::iterator::operator++()
+   {
+      uint64_t next = _view.offset + detail::record_header_size + _view.size;
+      if( !_reader->read_record( next, _view ) )
+         _view.offset = uint64_t(-1);
+      return *this;
+   }
+
+   record_log_reader::record_log_reader()
+   :my( new detail::record_log_reader_impl() ){}
+
+   record_log_reader::record_log_reader( const fc::path& file )
+   :my( new detail::record_log_reader_impl() )
+   {
+      open( file );
+   }
+
+   record_log_reader::record_log_reader( record_log_reader&& m )
+   :my( fc::move(m.my) ){}
+
+   record_log_reader::~record_log_reader(){}
+
+   record_log_reader& record_log_reader::operator=( record_log_reader&& m )
+   {
+      my = fc::move(m.my);
+      return *this;
+   }
+
+   void record_log_reader::open( const fc::path& file )
+   {
+      my->_file = file;
+      refresh();
+   }
+
+   void record_log_reader::refresh()
+   { try {
+      my->_mapped_region.reset();
+      my->_file_mapping.reset();
+      my->_data = nullptr;
+      my->_size = fc::file_size( my->_file );
+      if( my->_size == 0 ) return; // empty files cannot be mapped
+
+      my->_file_mapping.reset( new fc::file_mapping( my->_file.generic_string().c_str(), fc::read_only ) );
+      my->_mapped_region.reset( new fc::mapped_region( *my->_file_mapping, fc::read_only, 0, my->_size ) );
+      my->_data = (const char*)my->_mapped_region->get_address();
+   } FC_RETHROW_EXCEPTIONS( warn, "mapping ${file}", ("file",my->_file) ) }
+
+   void record_log_reader::close()
+   {
+      my->_mapped_region.reset();
+      my->_file_mapping.reset();
+      my->_data = nullptr;
+      my->_size = 0;
+   }
+
+   bool record_log_reader::read_record( uint64_t pos, record_view& v )const
+   {
+      if( my->_size < detail::record_header_size || pos > my->_size - detail::record_header_size )
+         return false;
+
+      uint32_t header[2];
+      memcpy( header, my->_data + pos, sizeof(header) );
+      if( header[0] == 0 || header[0] > my->_size - pos - detail::record_header_size )
+         return false;
+
+      const char* data = my->_data + pos + detail::record_header_size;
+      if( detail::record_crc( data, header[0] ) != header[1] )
+         return false;
+
+      v.offset = pos;
+      v.data   = data;
+      v.size   = header[0];
+      return true;
+   }
+
+   record_log_reader::iterator record_log_reader::begin()const                  { return iterator( this, 0 );      }
+   record_log_reader::iterator record_log_reader::begin_at( uint64_t offset )const { return iterator( this, offset ); }
+
+   record_log_reader::iterator record_log_reader::end()const
+   {
+      iterator itr;
+      itr._reader      = this;
+      itr._view.offset = uint64_t(-1);
+      return itr;
+   }
+
+   uint64_t record_log_reader::valid_size()const
+   {
+      uint64_t valid = 0;
+      for( auto itr = begin(); itr != end(); ++itr )
+         valid = itr->offset + detail::record_header_size + itr->size;
+      return valid;
+   }
+
+} // namespace fc
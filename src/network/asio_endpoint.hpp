@@ -0,0 +1,34 @@
+#pragma once
+#include <fc/network/ip.hpp>
+#include <boost/asio.hpp>
+
+namespace fc { namespace ip { namespace detail {
+
+  /**
+   *  @param dual_stack - the address is for an IPv6 socket that also carries
+   *         IPv4, which requires IPv4 addresses in their mapped form and the
+   *         IPv4 wildcard to be widened to the IPv6 wildcard.
+   */
+  inline boost::asio::ip::address to_asio( const address& a, bool dual_stack = false ) {
+    if( !a.is_v4() ) return boost::asio::ip::address_v6( a.to_v6_bytes() );
+    if( !dual_stack ) return boost::asio::ip::address_v4( uint32_t(a) );
+    if( uint32_t(a) == 0 ) return boost::asio::ip::address_v6::any();
+    return boost::asio::ip::address_v6( a.to_v6_bytes() );
+  }
+
+  inline address from_asio( const boost::asio::ip::address& a ) {
+    if( a.is_v4() ) return address( uint32_t(a.to_v4().to_ulong()) );
+    return address( a.to_v6().to_bytes() );
+  }
+
+  template<typename Endpoint>
+  Endpoint to_asio( const endpoint& e, bool dual_stack = false ) {
+    return Endpoint( to_asio( e.get_address(), dual_stack ), e.port() );
+  }
+
+  template<typename Endpoint>
+  endpoint from_asio( const Endpoint& e ) {
+    return endpoint( from_asio( e.address() ), e.port() );
+  }
+
+} } } // namespace fc::ip::detail
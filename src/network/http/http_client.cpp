@@ -0,0 +1,286 @@
+#include <fc/network/http/client.hpp>
+#include <fc/network/tcp_socket.hpp>
+#include <fc/network/ip.hpp>
+#include <fc/thread/thread.hpp>
+#include <fc/exception/exception.hpp>
+#include <fc/log/logger.hpp>
+#include <algorithm>
+#include <deque>
+#include <map>
+
+namespace fc { namespace http {
+
+  namespace detail {
+    struct client_request
+    {
+       fc::string                  method;
+       fc::string                  path;
+       fc::string                  body;
+       headers                     hdrs;
+       fc::time_point              deadline;
+       fc::promise<http::reply>::ptr prom;
+    };
+    typedef std::shared_ptr<client_request> client_request_ptr;
+
+    /**
+     *  Requests are sent by a writer task in the order they are queued and
+     *  their replies are read by a reader task in the same order.
+     */
+    struct pooled_connection
+    {
+       pooled_connection():connected(false),writing(false),closed(false){}
+
+       http::connection                con;
+       /** sent or waiting to be sent, oldest first */
+       std::deque<client_request_ptr>  inflight;
+       std::deque<client_request_ptr>  to_send;
+       bool                            connected;
+       bool                            writing;
+       bool                            closed;
+    };
+    typedef std::shared_ptr<pooled_connection> pooled_connection_ptr;
+
+    struct host_pool
+    {
+       std::vector<pooled_connection_ptr> conns;
+       /** requests waiting for room on a connection */
+       std::deque<client_request_ptr>     waiting;
+    };
+  }
+
+  /**
+   *  All state is only touched from _thread, tasks hold a shared_ptr to the
+   *  impl so that it outlives them.
+   */
+  class client::impl : public std::enable_shared_from_this<client::impl>
+  {
+    public:
+      impl( const client::config& c )
+      :_config(c),_thread(&fc::thread::current()),_outstanding(0),_sweep_scheduled(false),_closed(false){}
+
+      void dispatch( const fc::ip::endpoint& ep, const detail::client_request_ptr& r ) {
+         if( _closed ) {
+           r->prom->set_exception( fc::exception_ptr( new fc::canceled_exception( FC_LOG_MESSAGE( warn, "http client closed" ) ) ) );
+           return;
+         }
+         ++_outstanding;
+         schedule_sweep();
+
+         auto& pool = _pools[ep];
+         auto  c    = pick( pool );
+         if( c ) assign( ep, c, r );
+         else    pool.waiting.push_back( r );
+      }
+
+      /** the least loaded connection with room, opening one if they are all busy */
+      detail::pooled_connection_ptr pick( detail::host_pool& pool ) {
+         detail::pooled_connection_ptr best;
+         for( auto itr = pool.conns.begin(); itr != pool.conns.end(); ++itr ) {
+           auto& c = *itr;
+           if( c->closed || c->inflight.size() >= _config.max_pipeline_depth ) continue;
+           if( !best || c->inflight.size() < best->inflight.size() ) best = c;
+         }
+         if( (!best || best->inflight.size()) && pool.conns.size() < _config.max_connections_per_host ) {
+           best = std::make_shared<detail::pooled_connection>();
+           pool.conns.push_back( best );
+         }
+         return best;
+      }
+
+      void assign( const fc::ip::endpoint& ep, const detail::pooled_connection_ptr& c, const detail::client_request_ptr& r ) {
+         c->inflight.push_back( r );
+         c->to_send.push_back( r );
+         if( !c->writing ) {
+           c->writing = true;
+           auto self = shared_from_this();
+           _thread->async( [=](){ self->write_loop( ep, c ); }, "http::client::write" );
+         }
+      }
+
+      /** moves waiting requests onto connections with room */
+      void pump( const fc::ip::endpoint& ep ) {
+         auto& pool = _pools[ep];
+         while( pool.waiting.size() ) {
+           auto c = pick( pool );
+           if( !c ) return;
+           auto r = pool.waiting.front();
+           pool.waiting.pop_front();
+           assign( ep, c, r );
+         }
+      }
+
+      void write_loop( const fc::ip::endpoint& ep, const detail::pooled_connection_ptr& c ) {
+         try {
+           if( !c->connected ) {
+             c->con.connect_to( ep );
+             c->connected = true;
+             auto self = shared_from_this();
+             _thread->async( [=](){ self->read_loop( ep, c ); }, "http::client::read" );
+           }
+           while( c->to_send.size() && !c->closed ) {
+             auto r = c->to_send.front();
+             c->to_send.pop_front();
+             c->con.send_request( r->method, r->path, r->body, r->hdrs );
+           }
+         } catch ( const fc::exception& e ) {
+           close_connection( ep, c, e.dynamic_copy_exception() );
+         }
+         c->writing = false;
+      }
+
+      void read_loop( const fc::ip::endpoint& ep, const detail::pooled_connection_ptr& c ) {
+         while( !c->closed ) {
+           http::reply rep;
+           try {
+             rep = c->con.read_reply();
+           } catch ( const fc::exception& e ) {
+             close_connection( ep, c, e.dynamic_copy_exception() );
+             return;
+           }
+           if( c->inflight.empty() ) {
+             close_connection( ep, c, fc::exception_ptr( new fc::exception(
+                               FC_LOG_MESSAGE( warn, "unsolicited HTTP reply from ${ep}", ("ep",ep) ) ) ) );
+             return;
+           }
+           auto r = c->inflight.front();
+           c->inflight.pop_front();
+           complete( r, rep );
+
+           if( !c->con.get_socket().is_open() ) { // the server asked to close the connection
+             close_connection( ep, c, fc::exception_ptr( new fc::eof_exception(
+                               FC_LOG_MESSAGE( warn, "connection closed by ${ep}", ("ep",ep) ) ) ) );
+             return;
+           }
+           pump( ep );
+         }
+      }
+
+      /** fails every request on c and moves the waiting requests to the remaining connections */
+      void close_connection( const fc::ip::endpoint& ep, const detail::pooled_connection_ptr& c, const fc::exception_ptr& e ) {
+         if( c->closed ) return;
+         c->closed = true;
+         try {
+           c->con.get_socket().close();
+         } catch ( const fc::exception& ) {}
+
+         auto& conns = _pools[ep].conns;
+         conns.erase( std::remove( conns.begin(), conns.end(), c ), conns.end() );
+
+         auto failed = fc::move( c->inflight );
+         c->inflight.clear();
+         c->to_send.clear();
+         for( auto itr = failed.begin(); itr != failed.end(); ++itr )
+           fail( *itr, e );
+         if( !_closed ) pump( ep );
+      }
+
+      void complete( const detail::client_request_ptr& r, const http::reply& rep ) {
+         if( r->prom->ready() ) return;
+         --_outstanding;
+         r->prom->set_value( rep );
+      }
+      void fail( const detail::client_request_ptr& r, const fc::exception_ptr& e ) {
+         if( r->prom->ready() ) return;
+         --_outstanding;
+         r->prom->set_exception( e );
+      }
+
+      /**
+       *  Deadlines are checked periodically rather than with a timer per
+       *  request, while there are requests outstanding.
+       */
+      void schedule_sweep() {
+         if( _sweep_scheduled || !_outstanding ) return;
+         _sweep_scheduled = true;
+         fc::microseconds period( std::min<int64_t>( std::max<int64_t>( _config.timeout.count() / 8, 10000 ), 1000000 ) );
+         std::weak_ptr<impl> weak = shared_from_this();
+         _thread->schedule( [=](){ if( auto self = weak.lock() ) self->sweep(); },
+                            fc::time_point::now() + period, "http::client::sweep" );
+      }
+
+      void sweep() {
+         _sweep_scheduled = false;
+         auto now = fc::time_point::now();
+         auto timeout = [&]( const detail::client_request_ptr& r ) {
+            fail( r, fc::exception_ptr( new fc::timeout_exception(
+                     FC_LOG_MESSAGE( warn, "${method} ${path} timed out", ("method",r->method)("path",r->path) ) ) ) );
+         };
+
+         for( auto p = _pools.begin(); p != _pools.end(); ++p ) {
+           auto& waiting = p->second.waiting;
+           while( waiting.size() && waiting.front()->deadline <= now ) {
+             timeout( waiting.front() );
+             waiting.pop_front();
+           }
+
+           // the replies to later requests are read and discarded, unless the oldest timed out
+           auto conns = p->second.conns;
+           for( auto c = conns.begin(); c != conns.end(); ++c ) {
+             auto& inflight = (*c)->inflight;
+             for( auto r = inflight.begin(); r != inflight.end(); ++r )
+               if( (*r)->deadline <= now ) timeout( *r );
+             if( inflight.size() && inflight.front()->deadline <= now )
+               close_connection( p->first, *c, fc::exception_ptr( new fc::timeout_exception(
+                                 FC_LOG_MESSAGE( warn, "connection to ${ep} timed out", ("ep",p->first) ) ) ) );
+           }
+         }
+         schedule_sweep();
+      }
+
+      void close() {
+         _closed = true;
+         auto e = fc::exception_ptr( new fc::canceled_exception( FC_LOG_MESSAGE( warn, "http client closed" ) ) );
+         for( auto p = _pools.begin(); p != _pools.end(); ++p ) {
+           auto waiting = fc::move( p->second.waiting );
+           p->second.waiting.clear();
+           for( auto r = waiting.begin(); r != waiting.end(); ++r ) fail( *r, e );
+
+           auto conns = p->second.conns;
+           for( auto c = conns.begin(); c != conns.end(); ++c ) close_connection( p->first, *c, e );
+         }
+         _pools.clear();
+      }
+
+      client::config                               _config;
+      fc::thread*                                  _thread;
+      std::map<fc::ip::endpoint,detail::host_pool> _pools;
+      uint64_t                                     _outstanding;
+      bool                                         _sweep_scheduled;
+      bool                                         _closed;
+  };
+
+  client::client( const config& c )
+  :my( std::make_shared<impl>( c ) ){}
+
+  client::~client() {
+    try {
+      close();
+    } catch ( const fc::exception& e ) {
+      wlog( "${e}", ("e", e.to_detail_string()) );
+    }
+  }
+
+  fc::future<http::reply> client::request( const fc::ip::endpoint& host, const fc::string& method,
+                                           const fc::string& path, const fc::string& body,
+                                           const headers& h ) {
+    auto r = std::make_shared<detail::client_request>();
+    r->method   = method;
+    r->path     = path;
+    r->body     = body;
+    r->hdrs     = h;
+    r->deadline = fc::time_point::now() + my->_config.timeout;
+    r->prom.reset( new fc::promise<http::reply>( "http::client::request" ) );
+
+    auto self = my;
+    if( &fc::thread::current() == my->_thread ) self->dispatch( host, r );
+    else my->_thread->async( [=](){ self->dispatch( host, r ); }, "http::client::dispatch" );
+    return fc::future<http::reply>( r->prom );
+  }
+
+  void client::close() {
+    auto self = my;
+    if( &fc::thread::current() == my->_thread ) self->close();
+    else my->_thread->async( [=](){ self->close(); }, "http::client::close" ).wait();
+  }
+
+} } // fc::http
@@ -7,60 +7,264 @@
 #include <fc/crypto/hex.hpp>
 #include <fc/log/logger.hpp>
 #include <fc/io/stdio.hpp>
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
 
 
+namespace fc { namespace http { namespace detail {
+
+  static bool iequals( const fc::string& a, const char* b ) {
+    size_t i = 0;
+    for( ; i < a.size() && b[i]; ++i )
+      if( tolower( (unsigned char)a[i] ) != tolower( (unsigned char)b[i] ) ) return false;
+    return i == a.size() && !b[i];
+  }
+
+  static const header* find_header( const std::vector<header>& hs, const char* key ) {
+    for( auto itr = hs.begin(); itr != hs.end(); ++itr )
+      if( iequals( itr->key, key ) ) return &*itr;
+    return nullptr;
+  }
+
+  static bool keep_alive( const fc::string& version, const std::vector<header>& hs ) {
+    auto con = find_header( hs, "Connection" );
+    if( con && iequals( con->val, "close" ) )      return false;
+    if( con && iequals( con->val, "keep-alive" ) ) return true;
+    return version == "HTTP/1.1";
+  }
+
+  static size_t content_length( const std::vector<header>& hs ) {
+    auto len = find_header( hs, "Content-Length" );
+    return len ? static_cast<size_t>( to_uint64( len->val ) ) : 0;
+  }
+
+  /** chunked is always the last transfer coding applied */
+  static bool is_chunked( const std::vector<header>& hs ) {
+    auto te = find_header( hs, "Transfer-Encoding" );
+    if( !te ) return false;
+    const fc::string& v = te->val;
+    size_t end = v.find_last_not_of( " \t" );
+    if( end == fc::string::npos ) return false;
+    size_t begin = v.find_last_of( ", \t", end );
+    begin = begin == fc::string::npos ? 0 : begin + 1;
+    return iequals( v.substr( begin, end + 1 - begin ), "chunked" );
+  }
+
+} } } // fc::http::detail
+
 class fc::http::connection::impl 
 {
   public:
-   fc::tcp_socket sock;
-   fc::ip::endpoint ep;
-   impl() {
-   }
-
-   int read_until( char* buffer, char* end, char c = '\n' ) {
-      char* p = buffer;
-     // try {
-          while( p < end && 1 == sock.readsome(p,1) ) {
-            if( *p == c ) {
-              *p = '\0';
-              return (p - buffer)-1;
-            }
-            ++p;
-          }
-     // } catch ( ... ) {
-     //   elog("%s", fc::current_exception().diagnostic_information().c_str() );
-        //elog( "%s", fc::except_str().c_str() );
-     // }
-      return (p-buffer);
+   fc::tcp_socket    sock;
+   fc::ip::endpoint  ep;
+   /** data read from sock that has not been parsed yet is buf[rpos,rend) */
+   std::vector<char> buf;
+   size_t            rpos;
+   size_t            rend;
+
+   /** 
+    *  Progress through the body of the message whose headers were read last,
+    *  body_remaining counts the bytes left in the body or in the current chunk.
+    */
+   bool              chunked;
+   bool              body_done;
+   bool              close_after_body;
+   uint64_t          body_remaining;
+   /** what is left of max_body_size for the rest of the body, the size of every chunk is taken from it */
+   uint64_t          body_allowance;
+   connection::config config;
+
+   impl( const connection::config& c )
+   :buf(8*1024),rpos(0),rend(0),chunked(false),body_done(true),close_after_body(false),body_remaining(0),
+    body_allowance(0),config(c) {
+   }
+
+   void reset() {
+      rpos = rend = 0;
+      body_done = true;
+      close_after_body = false;
+   }
+
+   /** reads whatever is available from the socket into the end of buf */
+   void fill() {
+      if( rpos == rend ) {
+        rpos = rend = 0;
+      } else if( rend == buf.size() ) {
+        if( rpos == 0 )
+          FC_THROW( "HTTP header line longer than ${n} bytes", ("n",buf.size()) );
+        memmove( buf.data(), buf.data() + rpos, rend - rpos );
+        rend -= rpos;
+        rpos  = 0;
+      }
+      rend += sock.readsome( buf.data() + rend, buf.size() - rend );
+   }
+
+   /**
+    *  Sets [b,e) to the next line without its line terminator, the range 
+    *  points into buf and is only valid until the next call.
+    */
+   void read_line( const char*& b, const char*& e ) {
+      size_t scanned = 0;
+      while( true ) {
+        const char* start = buf.data() + rpos;
+        const char* nl = (const char*)memchr( start + scanned, '\n', rend - rpos - scanned );
+        if( nl ) {
+          b = start;
+          e = nl > start && nl[-1] == '\r' ? nl - 1 : nl;
+          rpos += nl - start + 1;
+          return;
+        }
+        scanned = rend - rpos;
+        fill();
+      }
+   }
+
+   /** splits the next line at the first two spaces, as in a request or status line */
+   void read_start_line( fc::string& a, fc::string& b, fc::string& c ) {
+      skip_body(); // whatever the reader of the previous message left behind
+      const char* s; const char* e;
+      do { read_line( s, e ); } while( s == e ); // tolerate blank lines between messages
+      const char* sp1 = (const char*)memchr( s, ' ', e - s );
+      const char* sp2 = sp1 ? (const char*)memchr( sp1 + 1, ' ', e - sp1 - 1 ) : nullptr;
+      if( !sp1 ) FC_THROW( "malformed HTTP start line: ${l}", ("l",fc::string(s,e)) );
+      if( !sp2 ) sp2 = e;
+      a = fc::string( s, sp1 );
+      b = fc::string( sp1 + 1, sp2 );
+      c = sp2 < e ? fc::string( sp2 + 1, e ) : fc::string();
+   }
+
+   /** parses header lines up to and including the blank line that ends them, at most max_header_size bytes */
+   void read_headers( std::vector<header>& hs ) {
+      uint64_t allowance = config.max_header_size;
+      const char* s; const char* e;
+      for( read_line( s, e ); s != e; read_line( s, e ) ) {
+        uint64_t n = uint64_t( e - s ) + 2;
+        if( n > allowance )
+          FC_THROW( "HTTP headers larger than the limit of ${max} bytes", ("max",config.max_header_size) );
+        allowance -= n;
+        const char* colon = (const char*)memchr( s, ':', e - s );
+        if( !colon ) FC_THROW( "malformed HTTP header: ${l}", ("l",fc::string(s,e)) );
+        const char* v = colon + 1;
+        while( v < e && (*v == ' ' || *v == '\t') ) ++v;
+        hs.push_back( header( fc::string( s, colon ), fc::string( v, e ) ) );
+      }
+   }
+
+   /** takes what is already buffered and reads the rest straight from the socket */
+   void read_exact( char* d, size_t len ) {
+      size_t n = std::min( len, rend - rpos );
+      memcpy( d, buf.data() + rpos, n );
+      rpos += n;
+      if( n < len ) sock.read( d + n, len - n );
+   }
+
+   void expect_crlf() {
+      const char* s; const char* e;
+      read_line( s, e );
+      if( s != e ) FC_THROW( "malformed chunked body, expected CRLF after chunk" );
+   }
+
+   void begin_body( const std::vector<header>& hs, bool close_after ) {
+      chunked          = detail::is_chunked( hs );
+      body_remaining   = chunked ? 0 : detail::content_length( hs );
+      body_done        = false;
+      close_after_body = close_after;
+      body_allowance   = config.max_body_size;
+      take_allowance( body_remaining );
+      if( !chunked && body_remaining == 0 ) end_body();
+   }
+
+   /** throws if the body would grow past max_body_size */
+   void take_allowance( uint64_t n ) {
+      if( n > body_allowance )
+        FC_THROW( "HTTP body larger than the limit of ${max} bytes", ("max",config.max_body_size) );
+      body_allowance -= n;
+   }
+
+   void end_body() {
+      body_done = true;
+      if( close_after_body ) sock.close();
+   }
+
+   /** reads the size line of the next chunk, and the trailer after the last one */
+   void next_chunk() {
+      const char* s; const char* e;
+      read_line( s, e );
+      const char* p = s;
+      uint64_t size = 0;
+      for( ; p < e && isxdigit( (unsigned char)*p ); ++p ) {
+        if( size >> 60 ) FC_THROW( "HTTP chunk size overflow" );
+        size = (size << 4) | fc::from_hex( *p );
+      }
+      if( p == s ) FC_THROW( "malformed HTTP chunk size: ${l}", ("l",fc::string(s,e)) );
+      take_allowance( size );
+      body_remaining = size;
+      if( size == 0 ) {
+        std::vector<header> trailers;
+        read_headers( trailers );
+        end_body();
+      }
+   }
+
+   size_t read_body_some( char* d, size_t len ) {
+      if( !body_done && chunked && body_remaining == 0 ) next_chunk();
+      if( body_done ) FC_THROW_EXCEPTION( eof_exception, "end of HTTP body" );
+
+      size_t n = size_t( std::min<uint64_t>( len, body_remaining ) );
+      if( rpos == rend && n >= buf.size() ) {
+        n = sock.readsome( d, n ); // nothing to gain by copying through buf
+      } else {
+        if( rpos == rend ) fill();
+        n = std::min( n, rend - rpos );
+        memcpy( d, buf.data() + rpos, n );
+        rpos += n;
+      }
+
+      body_remaining -= n;
+      if( body_remaining == 0 ) {
+        if( chunked ) expect_crlf();
+        else          end_body();
+      }
+      return n;
+   }
+
+   /** grows b as the data arrives rather than by the size the peer claims */
+   void read_body( std::vector<char>& b ) {
+      const uint64_t step = 64*1024;
+      while( !body_done ) {
+        if( chunked && body_remaining == 0 ) { next_chunk(); continue; }
+        size_t n   = size_t( std::min( body_remaining, step ) );
+        size_t off = b.size();
+        b.resize( off + n );
+        read_exact( b.data() + off, n );
+        body_remaining -= n;
+        if( body_remaining ) continue;
+        if( chunked ) expect_crlf();
+        else          end_body();
+      }
+   }
+
+   void skip_body() {
+      char tmp[4096];
+      while( !body_done ) read_body_some( tmp, sizeof(tmp) );
+   }
+
+   fc::http::reply parse_reply_headers() {
+      fc::http::reply rep;
+      fc::string version, code, description;
+      read_start_line( version, code, description );
+      rep.status = static_cast<int>(to_int64(code));
+      read_headers( rep.headers );
+      begin_body( rep.headers, !detail::keep_alive( version, rep.headers ) );
+      return rep;
    }
 
    fc::http::reply parse_reply() {
       fc::http::reply rep;
       try {
-        std::vector<char> line(1024*8);
-        int s = read_until( line.data(), line.data()+line.size(), ' ' ); // HTTP/1.1
-        s = read_until( line.data(), line.data()+line.size(), ' ' ); // CODE
-        rep.status = static_cast<int>(to_int64(fc::string(line.data())));
-        s = read_until( line.data(), line.data()+line.size(), '\n' ); // DESCRIPTION
-        
-        while( (s = read_until( line.data(), line.data()+line.size(), '\n' )) > 1 ) {
-          fc::http::header h;
-          char* end = line.data();
-          while( *end != ':' )++end;
-          h.key = fc::string(line.data(),end);
-          ++end; // skip ':'
-          ++end; // skip space
-          char* skey = end;
-          while( *end != '\r' ) ++end;
-          h.val = fc::string(skey,end);
-          rep.headers.push_back(h);
-          if( h.key == "Content-Length" ) {
-             rep.body.resize( static_cast<size_t>(to_uint64( fc::string(h.val) ) ));
-          }
-        }
-        if( rep.body.size() ) {
-          sock.read( rep.body.data(), rep.body.size() );
-        }
+        rep = parse_reply_headers();
+        read_body( rep.body );
         return rep;
       } catch ( fc::exception& e ) {
         elog( "${exception}", ("exception",e.to_detail_string() ) );
@@ -71,33 +275,59 @@ class fc::http::connection::impl
    }
 };
 
+namespace fc { namespace http { namespace detail {
+
+  /** reads the body of the message whose headers were read last */
+  class body_istream : public fc::istream
+  {
+    public:
+      body_istream( connection::impl* c ):_con(c){}
+
+      virtual size_t readsome( char* buf, size_t len ) { return _con->read_body_some( buf, len ); }
+
+    private:
+      connection::impl* _con;
+  };
+
+} } } // fc::http::detail
+
 
 
 namespace fc { namespace http {
 
-         connection::connection()
-         :my( new connection::impl() ){}
+         connection::connection( const config& c )
+         :my( new connection::impl( c ) ){}
          connection::~connection(){}
 
 
 // used for clients
 void       connection::connect_to( const fc::ip::endpoint& ep ) {
   my->sock.close();
+  my->reset();
   my->sock.connect_to( my->ep = ep );
 }
 
 http::reply connection::request( const fc::string& method, 
                                 const fc::string& url, 
                                 const fc::string& body, const headers& he ) {
+  send_request( method, url, body, he );
+  return my->parse_reply();
+}
+
+void connection::send_request( const fc::string& method, 
+                               const fc::string& url, 
+                               const fc::string& body, const headers& he ) {
 	
   if( !my->sock.is_open() ) {
     wlog( "Re-open socket!" );
+    my->reset();
     my->sock.connect_to( my->ep );
   }
   try {
       fc::stringstream req;
       req << method <<" "<<url<<" HTTP/1.1\r\n";
-      req << "Host: localhost\r\n";
+      if( !detail::find_header( he, "Host" ) ) 
+        req << "Host: " << fc::string(my->ep) << "\r\n";
       req << "Content-Type: application/json\r\n";
       for( auto i = he.begin(); i != he.end(); ++i )
       {
@@ -107,16 +337,9 @@ http::reply connection::request( const fc::string& method,
       req << "\r\n"; 
       fc::string head = req.str();
 
-      my->sock.write( head.c_str(), head.size() );
-    //  fc::cerr.write( head.c_str() );
-
-      if( body.size() )  {
-          my->sock.write( body.c_str(), body.size() );
-    //      fc::cerr.write( body.c_str() );
-      }
-    //  fc::cerr.flush();
-
-      return my->parse_reply();
+      const_buffer bufs[2] = { const_buffer( head.c_str(), head.size() ),
+                               const_buffer( body.c_str(), body.size() ) };
+      my->sock.writev( bufs, 2 );
   } catch ( ... ) {
       my->sock.close();
       FC_THROW_EXCEPTION( exception, "Error Sending HTTP Request" ); // TODO: provide more info
@@ -124,44 +347,38 @@ http::reply connection::request( const fc::string& method,
   }
 }
 
+http::reply connection::read_reply() {
+  http::reply rep = my->parse_reply_headers();
+  my->read_body( rep.body );
+  return rep;
+}
+
+http::reply connection::read_reply_headers() {
+  return my->parse_reply_headers();
+}
+
+fc::istream_ptr connection::body_stream()const {
+  return std::make_shared<detail::body_istream>( my.get() );
+}
+
 // used for servers
 fc::tcp_socket& connection::get_socket()const {
   return my->sock;
 }
 
 http::request    connection::read_request()const {
-  http::request req;
-  std::vector<char> line(1024*8);
-  int s = my->read_until( line.data(), line.data()+line.size(), ' ' ); // METHOD
-  req.method = line.data();
-  s = my->read_until( line.data(), line.data()+line.size(), ' ' ); // PATH
-  req.path = line.data();
-  s = my->read_until( line.data(), line.data()+line.size(), '\n' ); // HTTP/1.0
-  
-  while( (s = my->read_until( line.data(), line.data()+line.size(), '\n' )) > 1 ) {
-    fc::http::header h;
-    char* end = line.data();
-    while( *end != ':' )++end;
-    h.key = fc::string(line.data(),end);
-    ++end; // skip ':'
-    ++end; // skip space
-    char* skey = end;
-    while( *end != '\r' ) ++end;
-    h.val = fc::string(skey,end);
-    req.headers.push_back(h);
-    if( h.key == "Content-Length" ) {
-       req.body.resize( static_cast<size_t>(to_uint64( fc::string(h.val) ) ));
-    }
-    if( h.key == "Host" ) {
-       req.domain = h.val;
-    }
-  }
-  // TODO: some common servers won't give a Content-Length, they'll use 
-  // Transfer-Encoding: chunked.  handle that here.
+  http::request req = read_request_headers();
+  my->read_body( req.body );
+  return req;
+}
 
-  if( req.body.size() ) {
-    my->sock.read( req.body.data(), req.body.size() );
-  }
+http::request    connection::read_request_headers()const {
+  http::request req;
+  my->read_start_line( req.method, req.path, req.version );
+  my->read_headers( req.headers );
+  if( auto host = detail::find_header( req.headers, "Host" ) )
+    req.domain = host->val;
+  my->begin_body( req.headers, false );
   return req;
 }
 
@@ -171,6 +388,9 @@ fc::string request::get_header( const fc::string& key )const {
   }
   return fc::string();
 }
+bool request::keep_alive()const {
+  return detail::keep_alive( version, headers );
+}
 std::vector<header> parse_urlencoded_params( const fc::string& f ) {
   int num_args = 0;
   for( size_t i = 0; i < f.size(); ++i ) {
@@ -3,7 +3,9 @@
 #include <fc/network/tcp_socket.hpp>
 #include <fc/io/sstream.hpp>
 #include <fc/io/stdio.hpp>
+#include <fc/exception/exception.hpp>
 #include <fc/log/logger.hpp>
+#include <stdio.h>
 
 
 namespace fc { namespace http {
@@ -11,43 +13,142 @@ namespace fc { namespace http {
   class server::response::impl : public fc::retainable
   {
     public:
-      impl( const fc::http::connection_ptr& c, const std::function<void()>& cont = std::function<void()>() )
-      :body_bytes_sent(0),body_length(0),con(c),handle_next_req(cont)
+      impl( const fc::http::connection_ptr& c, bool ka = false, bool chunk_ok = false, 
+            const std::function<void()>& cont = std::function<void()>() )
+      :body_bytes_sent(0),body_length(0),length_set(false),headers_sent(false),chunked(false),
+       chunked_ok(chunk_ok),keep_alive(ka),con(c),handle_next_req(cont)
       {}
 
-      void send_header() {
+      ~impl() {
+         try {
+            finish();
+         } catch ( const fc::exception& e ) {
+            wlog( "${e}", ("e", e.to_detail_string()) );
+            complete();
+         }
+      }
+
+      /** the status line and headers, sent along with the first block of the body */
+      fc::string header_string() {
          fc::stringstream ss;
          ss << "HTTP/1.1 " << rep.status << " ";
          switch( rep.status ) {
-            case fc::http::reply::OK: ss << "OK\n\r"; break;
-            case fc::http::reply::RecordCreated: ss << "Record Created\n\r"; break;
-            case fc::http::reply::NotFound: ss << "Not Found\n\r"; break;
-            case fc::http::reply::Found: ss << "Found\n\r"; break;
+            case fc::http::reply::OK: ss << "OK\r\n"; break;
+            case fc::http::reply::RecordCreated: ss << "Record Created\r\n"; break;
+            case fc::http::reply::BadRequest: ss << "Bad Request\r\n"; break;
+            case fc::http::reply::NotFound: ss << "Not Found\r\n"; break;
+            case fc::http::reply::MethodNotAllowed: ss << "Method Not Allowed\r\n"; break;
+            case fc::http::reply::Found: ss << "Found\r\n"; break;
             case fc::http::reply::InternalServerError: ss << "Internal Server Error\r\n"; break;
+            default: ss << "\r\n"; break;
          }
          for( uint32_t i = 0; i < rep.headers.size(); ++i ) {
             ss << rep.headers[i].key <<": "<<rep.headers[i].val <<"\r\n";
          }
-         ss << "Content-Length: "<<body_length<<"\r\n\r\n";
-         auto s = ss.str();
-         fc::cerr<<s<<"\n";
-         con->get_socket().write( s.c_str(), s.size() );
+         if( !keep_alive ) ss << "Connection: close\r\n";
+         if( chunked )         ss << "Transfer-Encoding: chunked\r\n";
+         else if( length_set ) ss << "Content-Length: "<<body_length<<"\r\n";
+         ss << "\r\n";
+         return ss.str();
+      }
+
+      /**
+       *  Without a length the body is chunked, or for HTTP/1.0 clients ends
+       *  when the connection is closed.
+       */
+      void send( const char* data, size_t len ) {
+         const_buffer bufs[4];
+         size_t       n = 0;
+         fc::string   head;
+         char         chunk_head[20];
+
+         if( !headers_sent ) {
+           headers_sent = true;
+           chunked      = !length_set && chunked_ok;
+           keep_alive   = keep_alive && (length_set || chunked);
+           head         = header_string();
+           bufs[n++]    = const_buffer( head.c_str(), head.size() );
+         }
+         if( chunked && len ) {
+           bufs[n++] = const_buffer( chunk_head, sprintf( chunk_head, "%llx\r\n", (unsigned long long)len ) );
+           bufs[n++] = const_buffer( data, len );
+           bufs[n++] = const_buffer( "\r\n", 2 );
+         } else if( len ) {
+           bufs[n++] = const_buffer( data, len );
+         }
+         con->get_socket().writev( bufs, n );
+
+         body_bytes_sent += len;
+         if( length_set && body_bytes_sent == int64_t(body_length) ) 
+           complete();
+      }
+
+      /** 
+       *  Ends the body of a response without a length.  A response dropped before 
+       *  it was completely sent also finishes here, empty responses are sent as is
+       *  and partial ones leave the connection unusable.
+       */
+      void finish() {
+         if( !handle_next_req ) return;
+         if( !headers_sent && (!length_set || body_length == 0) ) {
+           length_set = true;
+           send( nullptr, 0 );
+         } else if( chunked ) {
+           con->get_socket().write( "0\r\n\r\n", 5 );
+         } else {
+           con->get_socket().close();
+         }
+         complete();
+      }
+
+      /** lets the connection move on to the next request */
+      void complete() {
+         auto next = fc::move(handle_next_req);
+         handle_next_req = std::function<void()>();
+         if( next ) next();
       }
 
       http::reply           rep;
       int64_t               body_bytes_sent;
       uint64_t              body_length;
+      bool                  length_set;
+      bool                  headers_sent;
+      bool                  chunked;
+      /** the client understands chunked transfer encoding (HTTP/1.1) */
+      bool                  chunked_ok;
+      bool                  keep_alive;
       http::connection_ptr      con;
+      /** called once when the response has been sent */
       std::function<void()> handle_next_req;
   };
 
+  namespace detail {
+    /** writes the body of a response as it is produced */
+    class response_ostream : public fc::ostream
+    {
+      public:
+        response_ostream( const fc::shared_ptr<server::response::impl>& r ):_rep(r){}
+
+        virtual size_t writesome( const char* buf, size_t len ) { server::response(_rep).write( buf, len ); return len; }
+        virtual void   flush() {}
+        virtual void   close() { _rep->finish(); }
+
+      private:
+        fc::shared_ptr<server::response::impl> _rep;
+    };
+  }
+
 
   class server::impl 
   {
     public:
       impl(){}
-      impl(uint16_t p ) {
-        tcp_serv.listen(p);
+      impl( uint16_t p, const connection::config& cfg )
+      :con_config(cfg) {
+        // responses to pipelined requests must not wait on the client's delayed ack
+        fc::tcp_server::config c;
+        c.no_delay = true;
+        tcp_serv.listen( p, c );
         accept_complete = fc::async([this](){ this->accept_loop(); });
       }
       fc::future<void> accept_complete;
@@ -58,42 +159,67 @@ namespace fc { namespace http {
         }catch(...){}
       }
       void accept_loop() {
-            http::connection_ptr con = std::make_shared<http::connection>();
+            http::connection_ptr con = std::make_shared<http::connection>( con_config );
             while( tcp_serv.accept( con->get_socket() ) ) {
               ilog( "Accept Connection" );
-              fc::async( [=](){ handle_connection( con, on_req ); } );
-              con = std::make_shared<http::connection>();
+              fc::async( [=](){ handle_connection( con, on_req, on_stream_req ); } );
+              con = std::make_shared<http::connection>( con_config );
             }
       }
 
+      /**
+       *  Serves requests from c one at a time until either side asks to close
+       *  the connection.  Pipelined requests wait in the connection's buffer
+       *  until the response to the previous one has been sent.
+       */
       void handle_connection( const http::connection_ptr& c,  
-                              std::function<void(const http::request&, const server::response& s )> do_on_req ) {
+                              std::function<void(const http::request&, const server::response& s )> do_on_req,
+                              stream_request_handler do_on_stream ) {
          try {
-             http::server::response rep( fc::shared_ptr<response::impl>( new response::impl(c, [=](){ this->handle_connection(c,do_on_req); } ) ) );
-             auto req = c->read_request();
-             if( do_on_req ) do_on_req( req, rep );
-             c->get_socket().close();
+             while( c->get_socket().is_open() ) {
+               auto req = do_on_stream ? c->read_request_headers() : c->read_request();
+               bool keep_alive = req.keep_alive();
+               fc::promise<void>::ptr sent( new fc::promise<void>("http::server::response") );
+               {
+                 http::server::response rep( fc::shared_ptr<response::impl>( 
+                       new response::impl( c, keep_alive, req.version == "HTTP/1.1", [=](){ sent->set_value(); } ) ) );
+                 if( do_on_stream )   do_on_stream( req, c->body_stream(), rep );
+                 else if( do_on_req ) do_on_req( req, rep );
+               }
+               sent->wait();
+               if( !keep_alive ) break;
+             }
+          } catch ( const fc::eof_exception& ) {
+             // the client closed the connection between requests
           } catch ( fc::exception& e ) {
              wlog( "unable to read request ${1}", ("1", e.to_detail_string() ) );//fc::except_str().c_str());
+          } catch ( const std::exception& e ) {
+             wlog( "unable to read request ${1}", ("1", e.what() ) );
+          }
+          try {
+             c->get_socket().close();
+          } catch ( fc::exception& e ) {
+             wlog( "${e}", ("e", e.to_detail_string()) );
           }
-          wlog( "done handle connection" );
       }
       std::function<void(const http::request&, const server::response& s )> on_req;
+      stream_request_handler                                                on_stream_req;
+      connection::config                                                    con_config;
       fc::tcp_server                                                        tcp_serv;
   };
 
 
 
   server::server(){}
-  server::server( uint16_t port ) :my( new impl(port) ){}
+  server::server( uint16_t port, const connection::config& c ) :my( new impl(port,c) ){}
   server::server( server&& s ):my(fc::move(s.my)){}
 
   server& server::operator=(server&& s)      { fc_swap(my,s.my); return *this; }
 
   server::~server(){}
 
-  void server::listen( uint16_t p ) {
-    my.reset( new impl(p) );
+  void server::listen( uint16_t p, const connection::config& c ) {
+    my.reset( new impl(p,c) );
   }
 
 
@@ -107,44 +233,43 @@ namespace fc { namespace http {
   server::response& server::response::operator=(server::response&& s)      { fc_swap(my,s.my); return *this; }
 
   void server::response::add_header( const fc::string& key, const fc::string& val )const {
-     wlog( "Attempt to add header after sending headers" );
+     if( my->headers_sent ) {
+       wlog( "Attempt to add header after sending headers" );
+     }
      my->rep.headers.push_back( fc::http::header( key, val ) );
   }
   void server::response::set_status( const http::reply::status_code& s )const {
-     if( my->body_bytes_sent != 0 ) {
+     if( my->headers_sent ) {
        wlog( "Attempt to set status after sending headers" );
      }
      my->rep.status = s;
   }
   void server::response::set_length( uint64_t s )const {
-    if( my->body_bytes_sent != 0 ) {
+    if( my->headers_sent ) {
       wlog( "Attempt to set length after sending headers" );
     }
     my->body_length = s; 
+    my->length_set  = true;
   }
   void server::response::write( const char* data, uint64_t len )const {
-    if( my->body_bytes_sent + len > my->body_length ) {
+    if( my->length_set && my->body_bytes_sent + len > my->body_length ) {
       wlog( "Attempt to send to many bytes.." );
-      len = my->body_bytes_sent + len - my->body_length;
-    }
-    if( my->body_bytes_sent == 0 ) {
-      my->send_header();
-    }
-    my->body_bytes_sent += len;
-    my->con->get_socket().write( data, static_cast<size_t>(len) ); 
-    if( my->body_bytes_sent == int64_t(my->body_length) ) {
-      if( my->handle_next_req ) {
-        ilog( "handle next request..." );
-        //fc::async( std::function<void()>(my->handle_next_req) );
-        fc::async( my->handle_next_req );
-      }
+      len = my->body_length - my->body_bytes_sent;
     }
+    my->send( data, static_cast<size_t>(len) );
+  }
+
+  fc::ostream_ptr server::response::body_stream()const {
+    return std::make_shared<detail::response_ostream>( my );
   }
 
   server::response::~response(){}
   void server::on_request( const std::function<void(const http::request&, const server::response& s )>& cb )
   { my->on_req = cb; }
 
+  void server::on_stream_request( const stream_request_handler& cb )
+  { my->on_stream_req = cb; }
+
 
 
 
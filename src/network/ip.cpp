@@ -1,36 +1,64 @@
 #include <fc/network/ip.hpp>
 #include <fc/crypto/city.hpp>
 #include <fc/variant.hpp>
+#include <fc/exception/exception.hpp>
 #include <boost/asio.hpp>
 #include <boost/lexical_cast.hpp>
 #include <string>
+#include <string.h>
 
 namespace fc { namespace ip {
 
-  address::address( uint32_t ip )
-  :_ip(ip){}
+  namespace detail {
+    static const unsigned char v4_mapped_prefix[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
 
-  address::address( const fc::string& s ) {
-    _ip = boost::asio::ip::address_v4::from_string(s.c_str()).to_ulong();
+    static address::v6_bytes parse( const fc::string& s ) {
+      auto a = boost::asio::ip::address::from_string( s.c_str() );
+      if( a.is_v4() ) return address( uint32_t(a.to_v4().to_ulong()) ).to_v6_bytes();
+      return a.to_v6().to_bytes();
+    }
+  }
+
+  address::address( uint32_t ip ) {
+    memcpy( _ip.data(), detail::v4_mapped_prefix, sizeof(detail::v4_mapped_prefix) );
+    _ip[12] = uint8_t(ip >> 24);
+    _ip[13] = uint8_t(ip >> 16);
+    _ip[14] = uint8_t(ip >> 8);
+    _ip[15] = uint8_t(ip);
   }
 
+  address::address( const v6_bytes& b )
+  :_ip(b){}
+
+  address::address( const fc::string& s )
+  :_ip( detail::parse(s) ){}
+
   bool operator==( const address& a, const address& b ) {
-    return uint32_t(a) == uint32_t(b);
+    return a._ip == b._ip;
   }
   bool operator!=( const address& a, const address& b ) {
-    return uint32_t(a) != uint32_t(b);
+    return a._ip != b._ip;
+  }
+  bool operator<( const address& a, const address& b ) {
+    return a._ip < b._ip;
   }
 
   address& address::operator=( const fc::string& s ) {
-    _ip = boost::asio::ip::address_v4::from_string(s.c_str()).to_ulong();
+    _ip = detail::parse(s);
     return *this;
   }
 
+  bool address::is_v4()const {
+    return memcmp( _ip.data(), detail::v4_mapped_prefix, sizeof(detail::v4_mapped_prefix) ) == 0;
+  }
+
   address::operator fc::string()const {
-    return boost::asio::ip::address_v4(_ip).to_string().c_str();
+    if( is_v4() ) return boost::asio::ip::address_v4( uint32_t(*this) ).to_string().c_str();
+    return boost::asio::ip::address_v6( _ip ).to_string().c_str();
   }
   address::operator uint32_t()const {
-    return _ip;
+    FC_ASSERT( is_v4(), "${ip} is not an IPv4 address", ("ip",fc::string(*this)) );
+    return uint32_t(_ip[12]) << 24 | uint32_t(_ip[13]) << 16 | uint32_t(_ip[14]) << 8 | _ip[15];
   }
 
 
@@ -48,8 +76,8 @@ namespace fc { namespace ip {
 
   bool operator< ( const endpoint& a, const endpoint& b )
   {
-     return  uint32_t(a.get_address()) < uint32_t(b.get_address()) ||
-             (uint32_t(a.get_address()) == uint32_t(b.get_address()) &&
+     return  a.get_address() < b.get_address() ||
+             (a.get_address() == b.get_address() &&
               uint32_t(a.port()) < uint32_t(b.port()));
   }
 
@@ -59,14 +87,26 @@ namespace fc { namespace ip {
   endpoint endpoint::from_string( const string& s ) {
     endpoint ep;
     const std::string& st = reinterpret_cast<const std::string&>(s);
-    auto pos = st.find(':');
-    ep._ip   = boost::asio::ip::address_v4::from_string(st.substr( 0, pos ) ).to_ulong();
-    ep._port = boost::lexical_cast<uint16_t>( st.substr( pos+1, s.size() ) );
+    size_t pos;
+    if( !st.empty() && st[0] == '[' ) {
+      size_t close = st.find(']');
+      FC_ASSERT( close != std::string::npos && close + 1 < st.size() && st[close+1] == ':',
+                 "expected [IPv6]:PORT, got ${s}", ("s",s) );
+      ep._ip = address( fc::string( st.substr( 1, close - 1 ).c_str() ) );
+      pos    = close + 1;
+    } else {
+      pos = st.rfind(':');
+      FC_ASSERT( pos != std::string::npos, "expected IP:PORT, got ${s}", ("s",s) );
+      ep._ip = address( fc::string( st.substr( 0, pos ).c_str() ) );
+    }
+    ep._port = boost::lexical_cast<uint16_t>( st.substr( pos+1 ) );
     return ep;
   }
 
   endpoint::operator string()const {
-    return string(_ip) + ':' + fc::string(boost::lexical_cast<std::string>(_port).c_str());
+    fc::string port( boost::lexical_cast<std::string>(_port).c_str() );
+    if( _ip.is_v6() ) return '[' + string(_ip) + "]:" + port;
+    return string(_ip) + ':' + port;
   }
 
   /**
@@ -76,10 +116,15 @@ namespace fc { namespace ip {
    *  172.16.0.0  to 172.31.255.255
    *  192.168.0.0 to 192.168.255.255
    *  169.254.0.0 to 169.254.255.255
+   *  fc00::/7 (unique local) and fe80::/10 (link local)
    *
    */
   bool address::is_private_address()const
   {
+    if( is_v6() )
+      return (_ip[0] & 0xfe) == 0xfc || (_ip[0] == 0xfe && (_ip[1] & 0xc0) == 0x80);
+
+    uint32_t ip = *this;
     static address min10_ip("10.0.0.0");
     static address max10_ip("10.255.255.255");
     static address min172_ip("172.16.0.0");
@@ -88,21 +133,22 @@ namespace fc { namespace ip {
     static address max192_ip("192.168.255.255");
     static address min169_ip("169.254.0.0");
     static address max169_ip("169.254.255.255");
-    if( _ip >= min10_ip._ip && _ip <= max10_ip._ip ) return true;
-    if( _ip >= min172_ip._ip && _ip <= max172_ip._ip ) return true;
-    if( _ip >= min192_ip._ip && _ip <= max192_ip._ip ) return true;
-    if( _ip >= min169_ip._ip && _ip <= max169_ip._ip ) return true;
+    if( ip >= uint32_t(min10_ip)  && ip <= uint32_t(max10_ip) )  return true;
+    if( ip >= uint32_t(min172_ip) && ip <= uint32_t(max172_ip) ) return true;
+    if( ip >= uint32_t(min192_ip) && ip <= uint32_t(max192_ip) ) return true;
+    if( ip >= uint32_t(min169_ip) && ip <= uint32_t(max169_ip) ) return true;
     return false;
   }
 
   /**
-   *  224.0.0.0 to 239.255.255.255
+   *  224.0.0.0 to 239.255.255.255 and ff00::/8
    */
   bool address::is_multicast_address()const
   {
+    if( is_v6() ) return _ip[0] == 0xff;
     static address min_ip("224.0.0.0");
     static address max_ip("239.255.255.255");
-    return  _ip >= min_ip._ip  && _ip <= max_ip._ip;
+    return  !(*this < min_ip) && !(max_ip < *this);
   }
 
   /** !private & !multicast */
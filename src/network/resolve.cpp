@@ -1,6 +1,8 @@
 #include <fc/asio.hpp>
 #include <fc/network/ip.hpp>
 
+#include "asio_endpoint.hpp"
+
 namespace fc
 {
   std::vector<fc::ip::endpoint> resolve( const fc::string& host, uint16_t port )
@@ -9,7 +11,7 @@ namespace fc
     std::vector<fc::ip::endpoint> eps;
     eps.reserve(ep.size());
     for( auto itr = ep.begin(); itr != ep.end(); ++itr )
-      eps.push_back( fc::ip::endpoint(itr->address().to_v4().to_ulong(), itr->port()) );
+      eps.push_back( fc::ip::detail::from_asio( *itr ) );
     return eps;
   }
 }
@@ -5,16 +5,24 @@
 #include <fc/log/logger.hpp>
 #include <fc/io/stdio.hpp>
 #include <fc/exception/exception.hpp>
+#include <fc/thread/thread.hpp>
+#include <algorithm>
+
+#include "asio_endpoint.hpp"
 
 namespace fc {
 
   class tcp_socket::impl {
     public:
-      impl():_sock( fc::asio::default_io_service() ){  }
+      impl()
+      :_sock( fc::asio::default_io_service() ),
+       _read_op("tcp_socket::read"),_write_op("tcp_socket::write"){  }
       ~impl(){
         if( _sock.is_open() ) _sock.close();
       }
       boost::asio::ip::tcp::socket _sock;
+      fc::asio::operation          _read_op;
+      fc::asio::operation          _write_op;
   };
   bool tcp_socket::is_open()const {
     return my->_sock.is_open();
@@ -39,28 +47,55 @@ namespace fc {
   }
 
   size_t   tcp_socket::writesome( const char* buf, size_t len ) {
-    return fc::asio::write_some( my->_sock, boost::asio::buffer( buf, len ) );
+    return fc::asio::write_some( my->_sock, boost::asio::buffer( buf, len ), my->_write_op );
+  }
+
+  ostream& tcp_socket::writev( const const_buffer* bufs, size_t n ) {
+    fc::asio::writev( my->_sock, bufs, n, &my->_write_op );
+    return *this;
   }
 
  fc::ip::endpoint tcp_socket::remote_endpoint()const
  {
    auto rep = my->_sock.remote_endpoint();
-   return  fc::ip::endpoint(rep.address().to_v4().to_ulong(), rep.port() );
+   return fc::ip::detail::from_asio( rep );
  }
 
   size_t tcp_socket::readsome( char* buf, size_t len ) {
-    auto r =  fc::asio::read_some( my->_sock, boost::asio::buffer( buf, len ) );
+    auto r =  fc::asio::read_some( my->_sock, boost::asio::buffer( buf, len ), my->_read_op );
     return r;
   }
 
   void tcp_socket::connect_to( const fc::ip::endpoint& e ) {
-    fc::asio::tcp::connect(my->_sock, fc::asio::tcp::endpoint( boost::asio::ip::address_v4(e.get_address()), e.port() ) ); 
+    fc::asio::tcp::connect( my->_sock, fc::ip::detail::to_asio<fc::asio::tcp::endpoint>(e) ); 
+  }
+
+  namespace detail {
+#ifdef SO_REUSEPORT
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
   }
 
   class tcp_server::impl {
     public:
-      impl(uint16_t port):
-      _accept( fc::asio::default_io_service(), boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port) ){
+      impl(uint16_t port, const tcp_server::config& c)
+      :_config(c),_accept( fc::asio::default_io_service() ){
+        // listen dual-stack where IPv6 is available, IPv4 clients appear as mapped addresses
+        boost::asio::ip::tcp::endpoint ep( boost::asio::ip::tcp::v6(), port );
+        boost::system::error_code ec;
+        _accept.open( ep.protocol(), ec );
+        if( !ec ) _accept.set_option( boost::asio::ip::v6_only(false), ec );
+        if( ec ) {
+          if( _accept.is_open() ) _accept.close();
+          ep = boost::asio::ip::tcp::endpoint( boost::asio::ip::tcp::v4(), port );
+          _accept.open( ep.protocol() );
+        }
+        _accept.set_option( boost::asio::ip::tcp::acceptor::reuse_address(c.reuse_address) );
+#ifdef SO_REUSEPORT
+        if( c.reuse_port ) _accept.set_option( detail::reuse_port(true) );
+#endif
+        _accept.bind( ep );
+        _accept.listen( c.backlog );
       }
       ~impl(){
         try {
@@ -72,6 +107,7 @@ namespace fc {
         }
       }
 
+      tcp_server::config             _config;
       boost::asio::ip::tcp::acceptor _accept;
   };
   void tcp_server::close() {
@@ -91,24 +127,93 @@ namespace fc {
     {
       if( !my ) return false;
 
-      fc::asio::tcp::accept( my->_accept, s.my->_sock  ); 
-      /*
-      fc::promise<void>::ptr p( new promise<void>("tcp::accept") );
-      my->_accept.async_accept( s.my->_sock, [=]( const boost::system::error_code& e ) {
-                    p->set_value(e);
-                } );
-      auto ec = p->wait();
-      if( ec ) FC_THROW_EXCEPTION( exception, "system error: ${message}", ("message", fc::string(boost::system::system_error(ec).what()) ));
-      return true;
-      */
+      try {
+        fc::asio::tcp::accept( my->_accept, s.my->_sock  ); 
+      } catch ( const fc::exception& ) {
+        // close() aborts a pending accept, that is not an error
+        if( !my ) return false;
+        throw;
+      }
+      if( my->_config.no_delay )
+        s.my->_sock.set_option( boost::asio::ip::tcp::no_delay(true) );
+      if( my->_config.keep_alive )
+        s.my->_sock.set_option( boost::asio::socket_base::keep_alive(true) );
       return true;
     } FC_RETHROW_EXCEPTIONS( warn, "Unable to accept connection on socket." );
   }
-  void tcp_server::listen( uint16_t port ) {
+  void tcp_server::listen( uint16_t port, const config& c ) {
     if( my ) delete my;
-    my = new impl(port);
+    my = nullptr;
+    try {
+      my = new impl(port,c);
+    } FC_RETHROW_EXCEPTIONS( warn, "Unable to listen on port ${port}", ("port",port) );
+  }
+
+
+  class tcp_server_group::impl {
+    public:
+      std::vector<fc::thread*>                  threads;
+      std::vector<std::shared_ptr<tcp_server>>  servers;
+      std::vector<fc::future<void>>             accept_loops;
+  };
+
+  tcp_server_group::tcp_server_group()
+  :my( new impl() ){}
+
+  tcp_server_group::~tcp_server_group() {
+    try {
+      close();
+    } catch ( const fc::exception& e ) {
+      wlog( "unexpected exception ${e}", ("e", e.to_detail_string()) );
+    }
   }
 
+  void tcp_server_group::listen( uint16_t port, const std::vector<fc::thread*>& threads, 
+                                 const accept_handler& on_accept, const tcp_server::config& c ) {
+    close();
+    tcp_server::config cfg = c;
+#ifdef SO_REUSEPORT
+    cfg.reuse_port = true;
+    size_t n = threads.size();
+#else
+    size_t n = std::min<size_t>( threads.size(), 1 );
+#endif
+    for( size_t i = 0; i < n; ++i ) {
+      auto srv = std::make_shared<tcp_server>();
+      // listen from the accepting thread so that its sockets use that thread's reactor
+      threads[i]->async( [=](){ srv->listen( port, cfg ); } ).wait();
+      my->threads.push_back( threads[i] );
+      my->servers.push_back( srv );
+      my->accept_loops.push_back( threads[i]->async( [=]() {
+        while( true ) {
+          auto s = std::make_shared<tcp_socket>();
+          try {
+            if( !srv->accept( *s ) ) return;
+          } catch ( const fc::canceled_exception& ) {
+            return;
+          } catch ( const fc::exception& e ) {
+            // out of file descriptors or similar, back off rather than spin
+            wlog( "${e}", ("e", e.to_detail_string()) );
+            fc::usleep( fc::milliseconds(10) );
+            continue;
+          }
+          fc::async( [=](){ on_accept( s ); }, "tcp_server_group::on_accept" );
+        }
+      }, "tcp_server_group::accept_loop" ) );
+    }
+  }
 
+  void tcp_server_group::close() {
+    for( size_t i = 0; i < my->servers.size(); ++i ) {
+      auto srv = my->servers[i];
+      my->threads[i]->async( [=](){ srv->close(); } ).wait();
+      try {
+        my->accept_loops[i].wait();
+      } catch ( const fc::canceled_exception& ) {}
+    }
+    my->threads.clear();
+    my->servers.clear();
+    my->accept_loops.clear();
+  }
 
 } // namespace fc 
@@ -2,25 +2,87 @@
 #include <fc/network/ip.hpp>
 #include <fc/fwd_impl.hpp>
 #include <fc/asio.hpp>
+#include <fc/thread/mutex.hpp>
+#include <fc/thread/scoped_lock.hpp>
+#include <fc/exception/exception.hpp>
 
+#include "asio_endpoint.hpp"
+#include <algorithm>
+#include <memory>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#define FC_HAS_MMSG
+#endif
 
 namespace fc {
-  
+
+  namespace detail {
+    static void throw_errno() {
+      throw boost::system::system_error( boost::system::error_code( errno, boost::asio::error::get_system_category() ) );
+    }
+
+#ifdef FC_HAS_MMSG
+    /** 
+     *  The arguments of one recvmmsg/sendmmsg call, kept by the socket so
+     *  that batches do not allocate.  Waiting for the socket yields, so each
+     *  is guarded by a mutex for as long as a call uses it.
+     */
+    struct mmsg_batch {
+      enum { max_size = 64 };
+      mmsghdr          hdr[max_size];
+      iovec            iov[max_size];
+      sockaddr_storage addr[max_size];
+      char             control[max_size][CMSG_SPACE(sizeof(int))];
+    };
+#endif
+  }
+
   class udp_socket::impl : public fc::retainable {
     public:
-      impl():_sock( fc::asio::default_io_service() ){}
+      impl()
+      :_sock( fc::asio::default_io_service() ),
+       _read_op("udp_socket::receive_from"),_write_op("udp_socket::send_to"),_dual_stack(false){}
       ~impl(){
       //  _sock.cancel();
       }
 
       boost::asio::ip::udp::socket _sock;
+      fc::asio::operation          _read_op;
+      fc::asio::operation          _write_op;
+      /** the socket is IPv6 with IPV6_V6ONLY cleared */
+      bool                         _dual_stack;
+#ifdef FC_HAS_MMSG
+      fc::mutex                           _recv_mutex;
+      std::unique_ptr<detail::mmsg_batch> _recv_batch;
+      fc::mutex                           _send_mutex;
+      std::unique_ptr<detail::mmsg_batch> _send_batch;
+#endif
+
+      /** blocks the current task until the socket is readable (or writable) */
+      void wait( bool for_write ) {
+        if( for_write ) {
+          auto p = _write_op.acquire();
+          _sock.async_send( boost::asio::null_buffers(), fc::asio::detail::reusable_op_handler(p) );
+          p->wait();
+        } else {
+          auto p = _read_op.acquire();
+          _sock.async_receive( boost::asio::null_buffers(), fc::asio::detail::reusable_op_handler(p) );
+          p->wait();
+        }
+      }
+
+      boost::asio::ip::udp::endpoint to_asio_ep( const fc::ip::endpoint& e )const {
+        return fc::ip::detail::to_asio<boost::asio::ip::udp::endpoint>( e, _dual_stack );
+      }
   };
 
-  boost::asio::ip::udp::endpoint to_asio_ep( const fc::ip::endpoint& e ) {
-    return boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4(e.get_address()), e.port() );
-  }
-  fc::ip::endpoint to_fc_ep( const boost::asio::ip::udp::endpoint& e ) {
-    return fc::ip::endpoint( e.address().to_v4().to_ulong(), e.port() );
+  static fc::ip::endpoint to_fc_ep( const boost::asio::ip::udp::endpoint& e ) {
+    return fc::ip::detail::from_asio( e );
   }
 
   udp_socket::udp_socket()
@@ -32,58 +94,187 @@ namespace fc {
   }
 
   size_t udp_socket::send_to( const char* b, size_t l, const ip::endpoint& to ) {
-    try {
-      return my->_sock.send_to( boost::asio::buffer(b, l), to_asio_ep(to) );
-    } catch( const boost::system::system_error& e ) {
-        if( e.code() == boost::asio::error::would_block ) {
-            promise<size_t>::ptr p(new promise<size_t>("udp_socket::send_to"));
-            my->_sock.async_send_to( boost::asio::buffer(b,l), to_asio_ep(to), 
-                [=]( const boost::system::error_code& ec, size_t bt ) {
-                    if( !ec ) p->set_value(bt);
-                    else 
-                      p->set_exception( fc::exception_ptr( new fc::exception( 
-                              FC_LOG_MESSAGE( error, "${message} ", 
-                              ("message", boost::system::system_error(ec).what())) ) ) );
-                });
-            return p->wait();
-        }
-        throw;
-    }
+    boost::system::error_code ec;
+    size_t r = my->_sock.send_to( boost::asio::buffer(b, l), my->to_asio_ep(to), 0, ec );
+    if( !ec ) return r;
+    if( ec != boost::asio::error::would_block ) throw boost::system::system_error(ec);
+
+    auto p = my->_write_op.acquire();
+    my->_sock.async_send_to( boost::asio::buffer(b,l), my->to_asio_ep(to), 
+                             fc::asio::detail::reusable_op_handler(p) );
+    return p->wait();
   }
   void udp_socket::open() {
-    my->_sock.open( boost::asio::ip::udp::v4() );
+    // prefer a dual-stack socket so that one socket can reach IPv4 and IPv6 peers
+    boost::system::error_code ec;
+    my->_sock.open( boost::asio::ip::udp::v6(), ec );
+    if( !ec ) my->_sock.set_option( boost::asio::ip::v6_only(false), ec );
+    my->_dual_stack = !ec;
+    if( ec ) {
+      if( my->_sock.is_open() ) my->_sock.close();
+      my->_sock.open( boost::asio::ip::udp::v4() );
+    }
     my->_sock.non_blocking(true);
   }
   void udp_socket::set_receive_buffer_size( size_t s ) {
     my->_sock.set_option(boost::asio::socket_base::receive_buffer_size(s) );
   }
   void udp_socket::bind( const fc::ip::endpoint& e ) {
-    my->_sock.bind( to_asio_ep(e) );
+    my->_sock.bind( my->to_asio_ep(e) );
   }
   size_t udp_socket::receive_from( char* b, size_t l, fc::ip::endpoint& _from ) {
-    try {
+    boost::asio::ip::udp::endpoint from;
+    boost::system::error_code ec;
+    size_t r = my->_sock.receive_from( boost::asio::buffer(b, l), from, 0, ec );
+    if( ec == boost::asio::error::would_block ) {
+        auto p = my->_read_op.acquire();
+        my->_sock.async_receive_from( boost::asio::buffer(b,l), from,
+                                      fc::asio::detail::reusable_op_handler(p) );
+        r = p->wait();
+    }
+    else if( ec ) throw boost::system::system_error(ec);
+    _from = to_fc_ep(from);
+    return r;
+  }
+  size_t udp_socket::receive_batch( datagram* d, size_t n ) {
+    if( n == 0 ) return 0;
+#ifdef FC_HAS_MMSG
+    fc::scoped_lock<fc::mutex> lock( my->_recv_mutex );
+    if( !my->_recv_batch ) my->_recv_batch.reset( new detail::mmsg_batch() );
+    detail::mmsg_batch& b = *my->_recv_batch;
+    n = std::min<size_t>( n, detail::mmsg_batch::max_size );
+    for( size_t i = 0; i < n; ++i ) {
+      b.iov[i].iov_base = d[i].data;
+      b.iov[i].iov_len  = d[i].size;
+      msghdr& h = b.hdr[i].msg_hdr;
+      h.msg_name       = &b.addr[i];
+      h.msg_namelen    = sizeof(b.addr[i]);
+      h.msg_iov        = &b.iov[i];
+      h.msg_iovlen     = 1;
+      h.msg_control    = b.control[i];
+      h.msg_controllen = sizeof(b.control[i]);
+      h.msg_flags      = 0;
+    }
+
+    int r;
+    while( (r = ::recvmmsg( my->_sock.native_handle(), b.hdr, unsigned(n), 0, nullptr )) < 0 ) {
+      if( errno == EINTR ) continue;
+      if( errno != EAGAIN && errno != EWOULDBLOCK ) detail::throw_errno();
+      my->wait( false );
+    }
+
+    for( int i = 0; i < r; ++i ) {
+      msghdr& h = b.hdr[i].msg_hdr;
+      d[i].length       = b.hdr[i].msg_len;
+      d[i].segment_size = 0;
+      d[i].truncated    = (h.msg_flags & MSG_TRUNC) != 0;
+#ifdef UDP_GRO
+      for( cmsghdr* c = CMSG_FIRSTHDR(&h); c; c = CMSG_NXTHDR(&h,c) ) {
+        if( c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO ) {
+          int seg;
+          memcpy( &seg, CMSG_DATA(c), sizeof(seg) );
+          d[i].segment_size = size_t(seg);
+        }
+      }
+#endif
       boost::asio::ip::udp::endpoint from;
-      size_t r =  my->_sock.receive_from( boost::asio::buffer(b, l), from );
-      _from = to_fc_ep(from);
-      return r;
-    } catch( const boost::system::system_error& e ) {
-        if( e.code() == boost::asio::error::would_block ) {
-            boost::asio::ip::udp::endpoint from;
-            promise<size_t>::ptr p(new promise<size_t>("udp_socket::send_to"));
-            my->_sock.async_receive_from( boost::asio::buffer(b,l), from,
-                [=]( const boost::system::error_code& ec, size_t bt ) {
-                    if( !ec ) p->set_value(bt);
-                    else p->set_exception( fc::exception_ptr( new fc::exception( 
-                              FC_LOG_MESSAGE( error, "${message} ", 
-                              ("message", boost::system::system_error(ec).what())) ) ) );
-                });
-            auto r =  p->wait();
-            _from = to_fc_ep(from);
-            return r;
+      memcpy( from.data(), &b.addr[i], h.msg_namelen );
+      from.resize( h.msg_namelen );
+      d[i].endpoint = to_fc_ep( from );
+    }
+    return size_t(r);
+#else
+    d[0].length       = receive_from( d[0].data, d[0].size, d[0].endpoint );
+    d[0].segment_size = 0;
+    d[0].truncated    = false;
+    size_t i = 1;
+    for( ; i < n; ++i ) {
+      boost::asio::ip::udp::endpoint from;
+      boost::system::error_code ec;
+      d[i].length = my->_sock.receive_from( boost::asio::buffer(d[i].data, d[i].size), from, 0, ec );
+      if( ec == boost::asio::error::would_block ) break;
+      if( ec ) throw boost::system::system_error(ec);
+      d[i].segment_size = 0;
+      d[i].truncated    = false;
+      d[i].endpoint     = to_fc_ep(from);
+    }
+    return i;
+#endif
+  }
+
+  size_t udp_socket::send_batch( const datagram* d, size_t n ) {
+#if defined(FC_HAS_MMSG)
+    fc::scoped_lock<fc::mutex> lock( my->_send_mutex );
+    if( !my->_send_batch ) my->_send_batch.reset( new detail::mmsg_batch() );
+    detail::mmsg_batch& b = *my->_send_batch;
+    for( size_t first = 0; first < n; ) {
+      size_t m = std::min<size_t>( n - first, detail::mmsg_batch::max_size );
+      for( size_t i = 0; i < m; ++i ) {
+        const datagram& g = d[first+i];
+        auto to = my->to_asio_ep( g.endpoint );
+        memcpy( &b.addr[i], to.data(), to.size() );
+        b.iov[i].iov_base = g.data;
+        b.iov[i].iov_len  = g.length;
+        msghdr& h = b.hdr[i].msg_hdr;
+        h.msg_name       = &b.addr[i];
+        h.msg_namelen    = socklen_t(to.size());
+        h.msg_iov        = &b.iov[i];
+        h.msg_iovlen     = 1;
+        h.msg_control    = nullptr;
+        h.msg_controllen = 0;
+        h.msg_flags      = 0;
+        if( g.segment_size && g.segment_size < g.length ) {
+#ifdef UDP_SEGMENT
+          h.msg_control    = b.control[i];
+          h.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+          cmsghdr* c = CMSG_FIRSTHDR(&h);
+          c->cmsg_level = SOL_UDP;
+          c->cmsg_type  = UDP_SEGMENT;
+          c->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+          uint16_t seg  = uint16_t(g.segment_size);
+          memcpy( CMSG_DATA(c), &seg, sizeof(seg) );
+#else
+          FC_THROW( "UDP segmentation offload is not supported on this platform" );
+#endif
         }
-        throw;
+      }
+
+      for( size_t sent = 0; sent < m; ) {
+        int r = ::sendmmsg( my->_sock.native_handle(), b.hdr + sent, unsigned(m - sent), 0 );
+        if( r < 0 ) {
+          if( errno == EINTR ) continue;
+          if( errno != EAGAIN && errno != EWOULDBLOCK ) detail::throw_errno();
+          my->wait( true );
+          continue;
+        }
+        sent += size_t(r);
+      }
+      first += m;
+    }
+#else
+    for( size_t i = 0; i < n; ++i ) {
+      const datagram& g = d[i];
+      size_t seg = g.segment_size ? g.segment_size : g.length;
+      size_t pos = 0;
+      do {
+        size_t len = std::min( seg, g.length - pos );
+        send_to( g.data + pos, len, g.endpoint );
+        pos += len;
+      } while( pos < g.length );
     }
+#endif
+    return n;
   }
+
+  bool udp_socket::enable_gro( bool e ) {
+#if defined(FC_HAS_MMSG) && defined(UDP_GRO)
+    int v = e ? 1 : 0;
+    return ::setsockopt( my->_sock.native_handle(), SOL_UDP, UDP_GRO, &v, sizeof(v) ) == 0 && e;
+#else
+    return false;
+#endif
+  }
+
   void   udp_socket::close() {
     //my->_sock.cancel(); 
     my->_sock.close();
@@ -93,12 +284,16 @@ namespace fc {
     return to_fc_ep( my->_sock.local_endpoint() );
   }
   void udp_socket::connect( const fc::ip::endpoint& e ) {
-     my->_sock.connect( to_asio_ep(e) );
+     my->_sock.connect( my->to_asio_ep(e) );
   }
 
   void   udp_socket::set_multicast_enable_loopback( bool s )
   {
     my->_sock.set_option( boost::asio::ip::multicast::enable_loopback(s) );
+    // asio picks the option level from the socket family, IPv4 groups on a
+    // dual-stack socket are still governed by the IPPROTO_IP level option
+    if( my->_dual_stack )
+      my->_sock.set_option( boost::asio::detail::socket_option::boolean<IPPROTO_IP, IP_MULTICAST_LOOP>(s) );
   }
   void   udp_socket::set_reuse_address( bool s )
   {
@@ -106,7 +301,17 @@ namespace fc {
   }
   void   udp_socket::join_multicast_group( const fc::ip::address& a )
   {
-    my->_sock.set_option( boost::asio::ip::multicast::join_group( boost::asio::ip::address_v4(a) ) );
+    if( my->_dual_stack && a.is_v4() ) {
+      // asio would build an IPv6 membership request for an IPv6 socket
+      ip_mreq req;
+      memset( &req, 0, sizeof(req) );
+      req.imr_multiaddr.s_addr = htonl( uint32_t(a) );
+      req.imr_interface.s_addr = htonl( INADDR_ANY );
+      if( ::setsockopt( my->_sock.native_handle(), IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&req, sizeof(req) ) != 0 )
+        detail::throw_errno();
+      return;
+    }
+    my->_sock.set_option( boost::asio::ip::multicast::join_group( fc::ip::detail::to_asio(a) ) );
   }
 
 }
@@ -1,156 +1,1007 @@
 #include <fc/rpc/json_connection.hpp>
 #include <fc/io/json.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/io/raw_variant.hpp>
 #include <boost/unordered_map.hpp>
+#include <algorithm>
+#include <deque>
 #include <fc/thread/thread.hpp>
 #include <fc/thread/scoped_lock.hpp>
 #include <fc/thread/mutex.hpp>
+#include <fc/thread/spin_lock.hpp>
 #include <fc/log/logger.hpp>
 #include <string>
+#include <string.h>
 
 namespace fc { namespace rpc {
 
    namespace detail
    {
+      /**
+       *  Starts each binary message, it can not begin a JSON text so the two
+       *  formats can be told apart on the same connection.
+       *
+       *  A binary message is the marker, the fc::raw packed uint32_t size of
+       *  the message that follows and the fc::raw packed message variant.
+       */
+      static const char binary_message_marker = char(0xfc);
+
+      /** appends to a string, so messages are serialized straight into the outbound buffer */
+      class string_ostream : public fc::ostream
+      {
+         public:
+            string_ostream( fc::string& s ):_str(s){}
+
+            virtual size_t writesome( const char* buf, size_t len ) { _str.append( buf, len ); return len; }
+            virtual void   close(){}
+            virtual void   flush(){}
+
+         private:
+            fc::string& _str;
+      };
+
+      /** the replies to a batch, sent together once every call in it has completed */
+      struct batch_reply
+      {
+         batch_reply():pending(0){}
+
+         /** null for members that get no reply */
+         variants                            replies;
+         uint32_t                            pending;
+         /** receives the replies instead of the output stream if set */
+         json_connection::message_handler    reply_to;
+      };
+      typedef std::shared_ptr<batch_reply> batch_reply_ptr;
+
+      /** the id of calls to methods that are not registered */
+      static const uint32_t no_method = uint32_t(-1);
+
+      struct pending_call
+      {
+         pending_call( const variant_object& m, uint32_t id, const fc::time_point& d,
+                       const batch_reply_ptr& b = batch_reply_ptr(), size_t i = 0 )
+         :msg(m),method(id),deadline(d),received(fc::time_point::now()),batch(b),index(i){}
+
+         variant_object  msg;
+         /** index of the method in the method table, or no_method */
+         uint32_t        method;
+         /** the call is not started after this, set from the timeout the caller sent */
+         fc::time_point  deadline;
+         /** when the call was read, the time until it starts is its queue time */
+         fc::time_point  received;
+         /** receives the reply instead of the output stream if set, @see json_connection::handle_message() */
+         json_connection::message_handler reply_to;
+         /** set if the call is part of a batch, its reply goes to batch->replies[index] */
+         batch_reply_ptr batch;
+         size_t          index;
+      };
+
+      /**
+       *  Counts durations in power of two buckets of microseconds, which is
+       *  enough for percentiles without keeping every sample.
+       */
+      class latency_histogram
+      {
+         public:
+            latency_histogram():_count(0),_total(0),_max(0)
+            {
+               memset( _buckets, 0, sizeof(_buckets) );
+            }
+
+            void record( const fc::microseconds& d )
+            {
+               uint64_t us = uint64_t( std::max<int64_t>( d.count(), 0 ) );
+               // bucket b holds durations below 2^b microseconds
+               uint32_t b = 0;
+               while( b + 1 < bucket_count && (uint64_t(1) << b) <= us ) ++b;
+               ++_buckets[b];
+               ++_count;
+               _total += us;
+               _max    = std::max( _max, us );
+            }
+
+            /** the counts and the upper bounds of the 50th, 90th and 99th percentiles */
+            variant_object snapshot()const
+            {
+               return mutable_variant_object( "count", _count )
+                                            ( "total_us", _total )
+                                            ( "max_us", _max )
+                                            ( "p50_us", percentile( 50 ) )
+                                            ( "p90_us", percentile( 90 ) )
+                                            ( "p99_us", percentile( 99 ) );
+            }
+
+         private:
+            static const uint32_t bucket_count = 32;
+
+            uint64_t percentile( uint32_t p )const
+            {
+               uint64_t rank = (_count * p + 99) / 100;
+               uint64_t seen = 0;
+               for( uint32_t b = 0; b < bucket_count && rank; ++b )
+               {
+                  seen += _buckets[b];
+                  if( seen >= rank ) return std::min( _max, (uint64_t(1) << b) - 1 );
+               }
+               return _max;
+            }
+
+            uint64_t _buckets[bucket_count];
+            uint64_t _count;
+            uint64_t _total;
+            uint64_t _max;
+      };
+
+      /** what happened to the calls of one method, only used on the thread running read_loop */
+      struct method_stats
+      {
+         method_stats():calls(0),errors(0){}
+
+         uint64_t          calls;
+         /** calls that threw, including those that expired before they started */
+         uint64_t          errors;
+         /** from when the call was read until it started */
+         latency_histogram queued;
+         latency_histogram handled;
+         /** of replies sent on the connection's output, batches are only counted for the connection */
+         latency_histogram serialized;
+      };
+
+      /** when a call ran, set by call_reply() on whichever thread runs the method */
+      struct call_timing
+      {
+         call_timing():failed(false){}
+
+         fc::time_point started;
+         fc::time_point finished;
+         bool           failed;
+      };
+
+      /**
+       *  Every name ever registered keeps its entry and id, removing a method
+       *  only clears its handlers, so ids held by queued calls stay valid.
+       */
+      struct method_entry
+      {
+         method_entry():local(false),max_concurrency(0),running(0){}
+
+         json_connection::method             positional;
+         json_connection::named_param_method named;
+         json_connection::generic_method     generic;
+         /** runs on the dispatching thread even with handler_threads, for the built in rpc.* methods */
+         bool                                local;
+
+         uint32_t                 max_concurrency;
+         uint32_t                 running;
+         /** calls that arrived while running == max_concurrency, oldest first */
+         std::deque<pending_call> waiting;
+         method_stats             stats;
+      };
+
+      /** a message published to a topic, waiting for the subscriber's credit */
+      struct queued_event
+      {
+         queued_event( const fc::string& k, const variant& m ):key(k),msg(m){}
+
+         fc::string key;
+         variant    msg;
+      };
+
+      /** the remote side's subscription to one of our topics */
+      struct subscriber
+      {
+         subscriber():credit(0),sending(false){}
+
+         fc::string               topic;
+         /** messages that may be sent before the subscriber grants more */
+         uint32_t                 credit;
+         std::deque<queued_event> queue;
+         /** sending may yield, only one fiber sends so the messages stay in order */
+         bool                     sending;
+      };
+
+      struct topic_entry
+      {
+         json_connection::topic_config config;
+         std::vector<uint64_t>         subscribers;
+      };
+
+      /** our subscription to a topic of the remote side */
+      struct subscription
+      {
+         subscription():window(0),handled(0),delivering(false){}
+
+         json_connection::event_handler on_event;
+         uint32_t                       window;
+         /** events handled since credit was last granted */
+         uint32_t                       handled;
+         /** received and not yet handled, at most window of them */
+         std::deque<variant>            events;
+         bool                           delivering;
+      };
+
+      /**
+       *  A promise for the reply to one of our calls.  The request id is the
+       *  slot index in the low 32 bits and the slot's generation in the high 32
+       *  bits, so a late or forged reply for a reused slot is ignored.
+       */
+      struct awaiting_slot
+      {
+         awaiting_slot():generation(0),deadline(fc::time_point::maximum()){}
+
+         fc::promise<variant>::ptr prom;
+         uint32_t                  generation;
+         fc::time_point            deadline;
+      };
+
+      /**
+       *  The calls waiting for a reply.  Calls may be made from any thread,
+       *  calls with a deadline are failed by a timer on the thread that created
+       *  the connection, which holds a weak_ptr so it may outlive the connection.
+       */
+      class awaiting_calls : public std::enable_shared_from_this<awaiting_calls>
+      {
+         public:
+            awaiting_calls()
+            :_thread(&fc::thread::current()),_timed(0),_next_sweep(fc::time_point::maximum()){}
+
+            /**
+             *  returns the request id to send with a call whose reply will complete p,
+             *  throws the reason the connection closed if it has
+             */
+            uint64_t add( const fc::promise<variant>::ptr& p, const fc::time_point& deadline )
+            {
+               bool schedule = false;
+               uint64_t id;
+               {
+                  fc::scoped_lock<fc::spin_lock> lock(_lock);
+                  if( _closed ) _closed->dynamic_rethrow_exception();
+                  uint32_t slot;
+                  if( _free_slots.size() )
+                  {
+                     slot = _free_slots.back();
+                     _free_slots.pop_back();
+                  }
+                  else
+                  {
+                     slot = uint32_t(_slots.size());
+                     _slots.push_back( awaiting_slot() );
+                  }
+                  auto& a = _slots[slot];
+                  a.prom     = p;
+                  a.deadline = deadline;
+                  if( deadline != fc::time_point::maximum() )
+                  {
+                     ++_timed;
+                     if( deadline < _next_sweep )
+                     {
+                        _next_sweep = deadline;
+                        schedule    = true;
+                     }
+                  }
+                  id = (uint64_t(a.generation) << 32) | slot;
+               }
+               if( schedule ) schedule_sweep( deadline );
+               return id;
+            }
+
+            /** frees the slot of a call, returns its promise or null if the id is not awaited */
+            fc::promise<variant>::ptr take( uint64_t id )
+            {
+               fc::scoped_lock<fc::spin_lock> lock(_lock);
+               uint32_t slot = uint32_t(id);
+               if( slot >= _slots.size() ) return fc::promise<variant>::ptr();
+
+               auto& a = _slots[slot];
+               if( a.generation != uint32_t(id >> 32) || !a.prom ) return fc::promise<variant>::ptr();
+               return release( slot );
+            }
+
+            /** frees every slot and fails later calls with e, returns the promises of the calls that were awaited */
+            std::vector<fc::promise<variant>::ptr> close( const fc::exception_ptr& e )
+            {
+               std::vector<fc::promise<variant>::ptr> all;
+               fc::scoped_lock<fc::spin_lock> lock(_lock);
+               if( !_closed ) _closed = e;
+               for( uint32_t slot = 0; slot < _slots.size(); ++slot )
+                  if( _slots[slot].prom ) all.push_back( release( slot ) );
+               return all;
+            }
+
+            /** calls waiting for a reply */
+            uint32_t size()
+            {
+               fc::scoped_lock<fc::spin_lock> lock(_lock);
+               return uint32_t( _slots.size() - _free_slots.size() );
+            }
+
+         private:
+            /** requires _lock */
+            fc::promise<variant>::ptr release( uint32_t slot )
+            {
+               auto& a = _slots[slot];
+               fc::promise<variant>::ptr p = fc::move(a.prom);
+               a.prom.reset();
+               if( a.deadline != fc::time_point::maximum() )
+               {
+                  --_timed;
+                  a.deadline = fc::time_point::maximum();
+               }
+               ++a.generation;
+               _free_slots.push_back( slot );
+               return p;
+            }
+
+            void schedule_sweep( const fc::time_point& when )
+            {
+               std::weak_ptr<awaiting_calls> weak = shared_from_this();
+               _thread->schedule( [=](){ if( auto self = weak.lock() ) self->sweep( when ); },
+                                  when, "json_connection::expire_calls" );
+            }
+
+            /** fails the calls whose deadline has passed and schedules the next sweep */
+            void sweep( const fc::time_point& scheduled )
+            {
+               std::vector<fc::promise<variant>::ptr> expired;
+               fc::time_point next = fc::time_point::maximum();
+               bool schedule = false;
+               {
+                  fc::scoped_lock<fc::spin_lock> lock(_lock);
+                  if( scheduled == _next_sweep ) _next_sweep = fc::time_point::maximum();
+
+                  auto now = fc::time_point::now();
+                  for( uint32_t slot = 0; _timed && slot < _slots.size(); ++slot )
+                  {
+                     auto& a = _slots[slot];
+                     if( a.deadline == fc::time_point::maximum() ) continue;
+                     if( a.deadline <= now ) expired.push_back( release( slot ) );
+                     else if( a.deadline < next ) next = a.deadline;
+                  }
+                  if( next < _next_sweep )
+                  {
+                     _next_sweep = next;
+                     schedule    = true;
+                  }
+               }
+               if( schedule ) schedule_sweep( next );
+
+               for( auto itr = expired.begin(); itr != expired.end(); ++itr )
+                  (*itr)->set_exception( exception_ptr( new timeout_exception(
+                                         FC_LOG_MESSAGE( warn, "no reply before the call's deadline" ) ) ) );
+            }
+
+            fc::thread*                 _thread;
+            fc::spin_lock               _lock;
+            std::vector<awaiting_slot>  _slots;
+            std::vector<uint32_t>       _free_slots;
+            /** slots with a deadline */
+            uint32_t                    _timed;
+            /** the earliest scheduled sweep, or maximum if there is none */
+            fc::time_point              _next_sweep;
+            /** why the connection closed, once it has */
+            fc::exception_ptr           _closed;
+      };
+
       class json_connection_impl 
       {
          public:
-            json_connection_impl( fc::buffered_istream_ptr&& in, fc::buffered_ostream_ptr&& out )
-            :_in(fc::move(in)),_out(fc::move(out)),_eof(false),_next_id(0),_logger("json_connection"){}
+            json_connection_impl( fc::buffered_istream_ptr&& in, fc::buffered_ostream_ptr&& out, const json_connection::config& c )
+            :_in(fc::move(in)),_out(fc::move(out)),_config(c),_eof(false),_awaiting(std::make_shared<awaiting_calls>()),_in_flight(0),_next_handler_thread(0),
+             _delivering(0),_messages_in(0),_unknown_calls(0),_next_subscription(0),_binary(c.format == json_connection::binary_format),_writing(false),
+             _messages_out(0),_bytes_out(0),_logger("json_connection")
+            {
+               add_subscription_methods();
+               add_local_method( "rpc.stats", [this]( const variant& ) -> variant { return variant( stats() ); } );
+            }
 
             fc::buffered_istream_ptr                                              _in;
             fc::buffered_ostream_ptr                                              _out;
+            json_connection::config                                               _config;
 
             fc::future<void>                                                      _done;
             bool                                                                  _eof;
 
-            uint64_t                                                              _next_id;
-            boost::unordered_map<uint64_t, fc::promise<variant>::ptr>             _awaiting;
-            boost::unordered_map<std::string, json_connection::method>            _methods;
-            boost::unordered_map<std::string, json_connection::named_param_method> _named_param_methods;
+            std::shared_ptr<awaiting_calls>                                       _awaiting;
+
+            /** method names are looked up once per call, then handled by index */
+            boost::unordered_map<std::string, uint32_t>                           _method_ids;
+            std::vector<method_entry>                                             _method_table;
 
+            /** requests dispatched and not yet completed, only used on the thread running read_loop */
+            uint32_t                                                              _in_flight;
+            size_t                                                                _next_handler_thread;
+            /** set while read_loop waits for _in_flight to drop below max_in_flight */
+            fc::promise<void>::ptr                                                _slot_free;
+            /** deliver() tasks running, they refer to this like the calls in flight do */
+            uint32_t                                                              _delivering;
+            /** set while the destructor waits for _in_flight and _delivering to reach 0 */
+            fc::promise<void>::ptr                                                _idle;
+            /** messages read or handed to handle_message(), a batch counts once */
+            uint64_t                                                              _messages_in;
+            /** calls of methods that are not registered */
+            uint64_t                                                              _unknown_calls;
+
+            /** publish and subscribe state, only used on the thread running read_loop */
+            boost::unordered_map<std::string, topic_entry>                        _topics;
+            boost::unordered_map<uint64_t, subscriber>                            _subscribers;
+            boost::unordered_map<uint64_t, subscription>                          _subscriptions;
+            uint64_t                                                              _next_subscription;
+
+            /** guards _binary, _outbox, _writing, _write_error, _outbox_drained and the output counters */
             fc::mutex                                                             _write_mutex;
+            /** messages are sent in binary_format */
+            bool                                                                  _binary;
+            /** complete messages waiting for the writer */
+            fc::string                                                            _outbox;
+            /** the offset of the end of each message in _outbox */
+            std::vector<size_t>                                                   _outbox_ends;
+            bool                                                                  _writing;
+            fc::future<void>                                                      _writer;
+            /** set once a write fails, later sends throw it */
+            fc::exception_ptr                                                     _write_error;
+            /** set while senders wait for the outbox to drop below max_outbox_bytes */
+            fc::promise<void>::ptr                                                _outbox_drained;
+            uint64_t                                                              _messages_out;
+            /** serialized into _outbox, the part still in it has not been written yet */
+            uint64_t                                                              _bytes_out;
+            /** of every message sent */
+            latency_histogram                                                     _serialized;
             //std::function<void(fc::exception_ptr)>                                _on_close;
 
             logger                                                                _logger;
 
-            void send_result( variant id, variant result )
+            /**
+             *  Serializes msg onto the end of the outbox in the connection's
+             *  format and starts the writer if it is not already running.
+             *  Waits while the outbox holds max_outbox_bytes, so a peer that
+             *  does not read holds up the calls replying to it, which keeps
+             *  them counted towards max_in_flight.
+             *
+             *  @return the time it took to serialize msg
+             */
+            fc::microseconds send_message( const variant& msg )
+            {
+               fc_dlog( _logger, "send: ${message}", ("message",msg) );
+               while( true )
+               {
+                  fc::promise<void>::ptr drained;
+                  {
+                     fc::scoped_lock<fc::mutex> lock(_write_mutex);
+                     if( _write_error ) _write_error->dynamic_rethrow_exception();
+                     if( !_config.max_outbox_bytes || _outbox.size() < _config.max_outbox_bytes )
+                        return append_message( msg );
+
+                     // the outbox is only this full while the writer is running, which wakes us
+                     if( !_outbox_drained )
+                        _outbox_drained.reset( new fc::promise<void>( "json_connection::outbox_drained" ) );
+                     drained = _outbox_drained;
+                  }
+                  drained->wait();
+               }
+            }
+
+            /** requires _write_mutex */
+            fc::microseconds append_message( const variant& msg )
             {
+               auto   begin = fc::time_point::now();
+               size_t first = _outbox.size();
+               string_ostream out( _outbox );
+               if( _binary )
+               {
+                  // the size is filled in once the message has been packed
+                  size_t start = _outbox.size();
+                  _outbox.push_back( binary_message_marker );
+                  _outbox.append( sizeof(uint32_t), '\0' );
+                  fc::raw::pack( out, msg );
+                  uint32_t size = uint32_t( _outbox.size() - start - 1 - sizeof(uint32_t) );
+                  memcpy( &_outbox[start + 1], &size, sizeof(size) );
+               }
+               else
+               {
+                  json::to_stream( out, msg );
+                  _outbox.push_back( '\n' );
+               }
+               _outbox_ends.push_back( _outbox.size() );
+               auto serialized = fc::time_point::now() - begin;
+               _serialized.record( serialized );
+               ++_messages_out;
+               _bytes_out += _outbox.size() - first;
+
+               if( !_writing )
                {
-                 fc::scoped_lock<fc::mutex> lock(_write_mutex);
-                 *_out << "{\"id\":";
-                 json::to_stream( *_out, id  );
-                 *_out << ",\"result\":";
-                 json::to_stream( *_out, result);
-                 *_out << "}\n";
+                  _writing = true;
+                  _writer  = fc::async( [=](){ write_loop(); }, "json_connection::write" );
                }
-               _out->flush();
+               return serialized;
             }
-            void send_error( variant id, fc::exception& e )
+
+            /**
+             *  Sends everything queued since the last write with one write and
+             *  flush, messages queued while a write is blocked go out together
+             *  in the next one.
+             */
+            void write_loop()
             {
+               fc::string batch;
+               while( true )
                {
-                 fc::scoped_lock<fc::mutex> lock(_write_mutex);
-                 *_out << "{\"id\":";
-                 json::to_stream( *_out, id  );
-                 *_out << ",\"error\":{\"message\":";
-                 json::to_stream( *_out, fc::string(e.what()) );
-                 *_out <<",\"code\":0,\"data\":";
-                 json::to_stream( *_out, variant(e));
-                 *_out << "}}\n";
+                  if( _config.max_batch_latency > fc::microseconds(0) && _outbox.size() < _config.max_batch_bytes )
+                     fc::usleep( _config.max_batch_latency );
+                  fc::promise<void>::ptr drained;
+                  {
+                     fc::scoped_lock<fc::mutex> lock(_write_mutex);
+                     drained = fc::move( _outbox_drained );
+                     _outbox_drained.reset();
+                     if( _outbox.empty() )
+                     {
+                        _writing = false;
+                        return;
+                     }
+                     if( _outbox.size() <= _config.max_batch_bytes )
+                     {
+                        std::swap( batch, _outbox );
+                        _outbox_ends.clear();
+                     }
+                     else
+                     {
+                        // split after the last message that fits, or after the first if none do
+                        auto itr = std::upper_bound( _outbox_ends.begin(), _outbox_ends.end(), size_t(_config.max_batch_bytes) );
+                        if( itr == _outbox_ends.begin() ) ++itr;
+                        size_t end = *(itr - 1);
+                        batch.assign( _outbox, 0, end );
+                        _outbox.erase( 0, end );
+                        _outbox_ends.erase( _outbox_ends.begin(), itr );
+                        for( auto e = _outbox_ends.begin(); e != _outbox_ends.end(); ++e ) *e -= end;
+                     }
+                  }
+                  if( drained ) drained->set_value();
+                  try
+                  {
+                     _out->write( batch.c_str(), batch.size() );
+                     _out->flush();
+                  }
+                  catch ( const fc::exception& e )
+                  {
+                     {
+                        fc::scoped_lock<fc::mutex> lock(_write_mutex);
+                        _write_error = e.dynamic_copy_exception();
+                        _outbox.clear();
+                        _outbox_ends.clear();
+                        _writing = false;
+                        // waiting senders see the error
+                        drained = fc::move( _outbox_drained );
+                        _outbox_drained.reset();
+                     }
+                     if( drained ) drained->set_value();
+                     close( e.dynamic_copy_exception() );
+                     return;
+                  }
+                  batch.clear();
                }
-               wlog(  "exception: ${except}", ("except", variant(e)) );
-               _out->flush();
             }
 
-            void handle_message( const variant_object& obj )
+            uint32_t intern( const fc::string& name )
             {
-              wlog(  "recv: ${msg}", ("msg", obj) );
-               try 
+               auto itr = _method_ids.find( name );
+               if( itr != _method_ids.end() ) return itr->second;
+               uint32_t id = uint32_t(_method_table.size());
+               _method_table.push_back( method_entry() );
+               _method_ids[name] = id;
+               return id;
+            }
+
+            void add_local_method( const fc::string& name, json_connection::generic_method m )
+            {
+               auto& e = _method_table[ intern(name) ];
+               e.generic = fc::move(m);
+               e.local   = true;
+            }
+
+            /**
+             *  rpc.subscribe, rpc.unsubscribe and rpc.credit are called by the
+             *  subscriber, rpc.event delivers a published message to it
+             */
+            void add_subscription_methods()
+            {
+               add_local_method( "rpc.subscribe", [this]( const variant& params ) -> variant
                {
-                  auto m = obj.find("method");
-                  auto i = obj.find("id");
-                  if( m != obj.end() )
+                  const variant_object& p = params.get_object();
+                  auto t = _topics.find( p["topic"].as_string() );
+                  FC_ASSERT( t != _topics.end(), "unknown topic ${topic}", ("topic",p["topic"]) );
+                  uint64_t id = p["subscription"].as_uint64();
+                  FC_ASSERT( _subscribers.find( id ) == _subscribers.end(), "subscription ${id} already exists", ("id",id) );
+
+                  auto& s = _subscribers[id];
+                  s.topic  = t->first;
+                  s.credit = uint32_t( p["credit"].as_uint64() );
+                  t->second.subscribers.push_back( id );
+                  return variant( id );
+               } );
+               add_local_method( "rpc.unsubscribe", [this]( const variant& params ) -> variant
+               {
+                  uint64_t id = params.get_object()["subscription"].as_uint64();
+                  auto s = _subscribers.find( id );
+                  if( s == _subscribers.end() ) return variant();
+                  auto& subs = _topics[s->second.topic].subscribers;
+                  subs.erase( std::remove( subs.begin(), subs.end(), id ), subs.end() );
+                  _subscribers.erase( s );
+                  return variant();
+               } );
+               add_local_method( "rpc.credit", [this]( const variant& params ) -> variant
+               {
+                  const variant_object& p = params.get_object();
+                  uint64_t id = p["subscription"].as_uint64();
+                  auto s = _subscribers.find( id );
+                  if( s != _subscribers.end() )
+                  {
+                     s->second.credit += uint32_t( p["credit"].as_uint64() );
+                     send_events( id );
+                  }
+                  return variant();
+               } );
+               add_local_method( "rpc.event", [this]( const variant& params ) -> variant
+               {
+                  const variant_object& p = params.get_object();
+                  uint64_t id = p["subscription"].as_uint64();
+                  auto s = _subscriptions.find( id );
+                  // events sent before an unsubscribe arrived are dropped
+                  if( s == _subscriptions.end() ) return variant();
+                  s->second.events.push_back( p["data"] );
+                  if( !s->second.delivering )
+                  {
+                     s->second.delivering = true;
+                     ++_delivering;
+                     fc::async( [=](){ deliver( id ); --_delivering; task_done(); }, "json_connection::deliver" );
+                  }
+                  return variant();
+               } );
+            }
+
+            void publish( const fc::string& topic, const variant& msg )
+            {
+               auto t = _topics.find( topic );
+               FC_ASSERT( t != _topics.end(), "unknown topic ${topic}", ("topic",topic) );
+               auto policy    = t->second.config.policy;
+               auto max_queue = t->second.config.max_queue;
+               fc::string key;
+               if( policy == json_connection::coalesce && t->second.config.coalesce_key )
+                  key = t->second.config.coalesce_key( msg );
+
+               // sending may yield to fibers that change the subscribers
+               auto subscribers = t->second.subscribers;
+               for( auto id = subscribers.begin(); id != subscribers.end(); ++id )
+               {
+                  auto s = _subscribers.find( *id );
+                  if( s == _subscribers.end() ) continue;
+
+                  auto& queue = s->second.queue;
+                  auto  same  = queue.end();
+                  if( policy == json_connection::coalesce )
+                     same = std::find_if( queue.begin(), queue.end(), [&]( const queued_event& e ){ return e.key == key; } );
+
+                  if( same != queue.end() )
+                     same->msg = msg;
+                  else if( queue.size() < max_queue )
+                     queue.push_back( queued_event( key, msg ) );
+                  else if( policy != json_connection::drop_newest )
+                  {
+                     queue.pop_front();
+                     queue.push_back( queued_event( key, msg ) );
+                  }
+                  send_events( *id );
+               }
+            }
+
+            /** sends queued messages to a subscriber while it has credit */
+            void send_events( uint64_t id )
+            {
+               auto s = _subscribers.find( id );
+               if( s == _subscribers.end() || s->second.sending ) return;
+               s->second.sending = true;
+               try
+               {
+                  while( s->second.credit && !s->second.queue.empty() )
+                  {
+                     variant msg = fc::move( s->second.queue.front().msg );
+                     s->second.queue.pop_front();
+                     --s->second.credit;
+                     send_message( mutable_variant_object( "method", "rpc.event" )
+                                   ( "params", mutable_variant_object( "subscription", id )( "data", fc::move(msg) ) ) );
+
+                     // the subscriber may have unsubscribed while sending
+                     s = _subscribers.find( id );
+                     if( s == _subscribers.end() ) return;
+                  }
+               }
+               catch ( ... )
+               {
+                  s = _subscribers.find( id );
+                  if( s != _subscribers.end() ) s->second.sending = false;
+                  throw;
+               }
+               s->second.sending = false;
+            }
+
+            /** calls on_event for each event received, granting credit as they are handled */
+            void deliver( uint64_t id )
+            {
+               try
+               {
+                  while( true )
                   {
+                     auto s = _subscriptions.find( id );
+                     if( s == _subscriptions.end() ) return;
+                     if( s->second.events.empty() )
+                     {
+                        s->second.delivering = false;
+                        return;
+                     }
+                     variant event = fc::move( s->second.events.front() );
+                     s->second.events.pop_front();
+
+                     // on_event may unsubscribe
+                     auto on_event = s->second.on_event;
                      try
                      {
-                        auto p = obj.find("params");
-                        variant result;
-                        if( p == obj.end() )
-                        {
-                           auto pmi = _methods.find(m->value().as_string());
-                           auto nmi = _named_param_methods.find(m->value().as_string());
-                           if( pmi != _methods.end()  )
-                           {
-                               result = pmi->second( variants() );
-                           }
-                           else if( nmi != _named_param_methods.end() )
-                           {
-                               result = nmi->second( variant_object() );
-                           }
-                           else // invalid method
-                           {
-                              FC_THROW_EXCEPTION( exception, "Invalid Method '${method}'", ("method",m->value().as_string()));
-                           }
-                        }
-                        else if( p->value().is_array() )
-                        {
-                           auto pmi = _methods.find(m->value().as_string());
-                           if( pmi != _methods.end()  )
-                           {
-                               result = pmi->second( p->value().get_array() );
-                           }
-                           else // invalid method / param combo
-                           {
-                              FC_THROW_EXCEPTION( exception, "Invalid method or params  '${method}'", 
-                                                  ("method",m->value().as_string()));
-                           }
-                        
-                        }
-                        else if( p->value().is_object() )
-                        {
-                           auto nmi = _named_param_methods.find(m->value().as_string());
-                           if( nmi != _named_param_methods.end() )
-                           {
-                               result = nmi->second( p->value().get_object() );
-                           }
-                           else // invalid method / param combo?
-                           {
-                              FC_THROW_EXCEPTION( exception, "Invalid method or params  '${method}'", 
-                                                  ("method",m->value().as_string()));
-                           }
-                        }
-                        else // invalid params
-                        {
-                            FC_THROW_EXCEPTION( exception, "Invalid Params for method ${method}", 
-                                                    ("method",m->value().as_string()));
-                        }
-                        if( i != obj.end() )
-                        {
-                           send_result( i->value(), result );
-                        }
+                        on_event( event );
                      }
-                     catch ( fc::exception& e )
+                     catch ( const fc::exception& e )
                      {
-                        if( i != obj.end() )
-                        {
-                           send_error( i->value(), e );
-                        }
-                        else
-                        {
-                           fc_wlog( _logger, "json rpc exception: ${exception}", ("exception",e) );
-                        }
+                        fc_wlog( _logger, "subscription handler exception: ${exception}", ("exception",e) );
+                     }
+                     catch ( const std::exception& e )
+                     {
+                        fc_wlog( _logger, "subscription handler exception: ${exception}", ("exception",e.what()) );
                      }
+
+                     s = _subscriptions.find( id );
+                     if( s == _subscriptions.end() ) return;
+                     auto& sub = s->second;
+                     if( ++sub.handled >= std::max<uint32_t>( sub.window / 2, 1 ) )
+                     {
+                        uint32_t credit = sub.handled;
+                        sub.handled = 0;
+                        send_message( mutable_variant_object( "method", "rpc.credit" )
+                                      ( "params", mutable_variant_object( "subscription", id )( "credit", credit ) ) );
+                     }
+                  }
+               }
+               catch ( const fc::exception& e ) // the connection closed
+               {
+                  fc_wlog( _logger, "unable to grant credit: ${exception}", ("exception",e) );
+               }
+            }
+
+            /** looks up the method a call names without copying the name */
+            uint32_t resolve( const variant& name )const
+            {
+               if( !name.is_string() ) return no_method;
+               auto itr = _method_ids.find( name.get_string() );
+               return itr != _method_ids.end() ? itr->second : no_method;
+            }
+
+            /** sends a reply, unless it was asked for by handle_message(), returns the time spent serializing it */
+            fc::microseconds send_reply( const json_connection::message_handler& to, const variant& msg )
+            {
+               if( !to ) return send_message( msg );
+               to( msg );
+               return fc::microseconds(0);
+            }
+
+
+            /** the deadline of a call, calls without one get the configured call_timeout */
+            fc::time_point call_deadline( const fc::time_point& deadline, const fc::time_point& now )const
+            {
+               if( deadline != fc::time_point::maximum() || _config.call_timeout == fc::microseconds::maximum() )
+                  return deadline;
+               return now + _config.call_timeout;
+            }
+
+            /** the time left is sent rather than the deadline, so the clocks need not agree */
+            static void add_timeout( mutable_variant_object& msg, const fc::time_point& deadline, const fc::time_point& now )
+            {
+               if( deadline != fc::time_point::maximum() )
+                  msg( "timeout", (deadline - now).count() );
+            }
+
+            /** the local deadline of a request that carries a timeout */
+            static fc::time_point request_deadline( const variant_object& obj )
+            {
+               auto t = obj.find("timeout");
+               if( t == obj.end() || !t->value().is_numeric() ) return fc::time_point::maximum();
+               return fc::time_point::now() + fc::microseconds( t->value().as_int64() );
+            }
+
+            /** registers a promise for the reply to a call, then sends the call */
+            future<variant> call( const fc::string& method, variant params,
+                                  const json_connection::reply_handler& on_reply = json_connection::reply_handler(),
+                                  fc::time_point deadline = fc::time_point::maximum() )
+            {
+               auto p  = fc::promise<variant>::ptr( new fc::promise<variant>() );
+               if( on_reply ) p->on_complete( json_connection::reply_handler( on_reply ) );
+
+               auto now = fc::time_point::now();
+               deadline = call_deadline( deadline, now );
+               if( deadline <= now )
+               {
+                  p->set_exception( exception_ptr( new timeout_exception(
+                                    FC_LOG_MESSAGE( warn, "the deadline of ${method} passed before it was sent", ("method",method) ) ) ) );
+                  return p;
+               }
+
+               uint64_t id = _awaiting->add( p, deadline );
+               try
+               {
+                  mutable_variant_object msg( "id", id );
+                  msg( "method", method );
+                  if( !params.is_null() ) msg( "params", fc::move(params) );
+                  add_timeout( msg, deadline, now );
+                  send_message( fc::move(msg) );
+               }
+               catch ( ... )
+               {
+                  _awaiting->take( id );
+                  throw;
+               }
+               return p;
+            }
+
+            /** calls the method c was resolved to, throws if it does not exist, fails or has expired */
+            variant invoke( const pending_call& c )
+            {
+               const variant_object& obj = c.msg;
+               // the name is only needed to report errors
+               auto method = [&](){ return obj["method"]; };
+               const method_entry* m = c.method < _method_table.size() ? &_method_table[c.method] : nullptr;
+
+               // the caller has given up, do not start work nobody will see
+               if( c.deadline != fc::time_point::maximum() && c.deadline <= fc::time_point::now() )
+                  FC_THROW_EXCEPTION( timeout_exception, "the deadline of '${method}' passed before it started", ("method",method()) );
+
+               auto p = obj.find("params");
+               if( m && m->generic )
+               {
+                  return m->generic( p != obj.end() ? p->value() : variant() );
+               }
+               if( p == obj.end() )
+               {
+                  if( m && m->positional )
+                  {
+                      return m->positional( variants() );
+                  }
+                  else if( m && m->named )
+                  {
+                      return m->named( variant_object() );
+                  }
+                  else // invalid method
+                  {
+                     FC_THROW_EXCEPTION( exception, "Invalid Method '${method}'", ("method",method()));
+                  }
+               }
+               else if( p->value().is_array() )
+               {
+                  if( m && m->positional )
+                  {
+                      return m->positional( p->value().get_array() );
+                  }
+                  else // invalid method / param combo
+                  {
+                     FC_THROW_EXCEPTION( exception, "Invalid method or params  '${method}'", 
+                                         ("method",method()));
+                  }
+               
+               }
+               else if( p->value().is_object() )
+               {
+                  if( m && m->named )
+                  {
+                      return m->named( p->value().get_object() );
+                  }
+                  else // invalid method / param combo?
+                  {
+                     FC_THROW_EXCEPTION( exception, "Invalid method or params  '${method}'", 
+                                         ("method",method()));
+                  }
+               }
+               else // invalid params
+               {
+                   FC_THROW_EXCEPTION( exception, "Invalid Params for method ${method}", 
+                                           ("method",method()));
+               }
+            }
+
+            static variant error_object( const fc::exception& e )
+            {
+               return mutable_variant_object( "message", fc::string(e.what()) )( "code", 0 )( "data", variant(e) );
+            }
+
+            /** handles a call, returns its reply or null if it has no id */
+            variant call_reply( const pending_call& c, call_timing& timing )
+            {
+               const variant_object& obj = c.msg;
+               auto i = obj.find("id");
+               timing.started = fc::time_point::now();
+               try
+               {
+                  variant result = invoke( c );
+                  timing.finished = fc::time_point::now();
+                  if( i == obj.end() ) return variant();
+                  return mutable_variant_object( "id", i->value() )( "result", fc::move(result) );
+               }
+               catch ( fc::exception& e )
+               {
+                  return error_reply( obj, timing, e );
+               }
+               catch ( const std::exception& e )
+               {
+                  return error_reply( obj, timing, FC_EXCEPTION( exception, "${what}", ("what",e.what()) ) );
+               }
+               catch ( ... )
+               {
+                  return error_reply( obj, timing, FC_EXCEPTION( exception, "unknown exception" ) );
+               }
+            }
+
+            /** the reply to a call that could not be answered, or null if it has no id */
+            static variant internal_error( const variant_object& obj )
+            {
+               auto i = obj.find("id");
+               if( i == obj.end() ) return variant();
+               return mutable_variant_object( "id", i->value() )
+                      ( "error", mutable_variant_object( "message", "Internal error" )( "code", -32603 ) );
+            }
+
+            /** the reply to a call that threw e, or null if it has no id */
+            variant error_reply( const variant_object& obj, call_timing& timing, const fc::exception& e )
+            {
+               timing.finished = fc::time_point::now();
+               timing.failed   = true;
+               auto i = obj.find("id");
+               if( i == obj.end() )
+               {
+                  fc_wlog( _logger, "json rpc exception: ${exception}", ("exception",e) );
+                  return variant();
+               }
+               return mutable_variant_object( "id", i->value() )( "error", error_object(e) );
+            }
+
+            void send_batch( const batch_reply& b )
+            {
+               variants replies;
+               replies.reserve( b.replies.size() );
+               for( auto itr = b.replies.begin(); itr != b.replies.end(); ++itr )
+                  if( !itr->is_null() ) replies.push_back( *itr );
+
+               // a batch of notifications gets no reply at all
+               if( replies.empty() )
+               {
+                  if( b.reply_to ) b.reply_to( variant() );
+                  return;
+               }
+               send_reply( b.reply_to, variant( fc::move(replies) ) );
+            }
+
+            void handle_reply( const variant_object& obj )
+            {
+               try 
+               {
+                  auto i = obj.find("id");
+                  // ids we send are always integers; a null, string or negative id (e.g. the
+                  // reply to a request that could not be parsed) must not complete call 0
+                  if( i != obj.end() && !i->value().is_uint64() && !(i->value().is_int64() && i->value().as_int64() >= 0) )
+                  {
+                     fc_wlog( _logger, "ignoring reply with id ${id}", ("id",i->value()) );
                   }
                   else if( i != obj.end() )
                   {
-                     uint64_t id = i->value().as_int64();
-                     auto await = _awaiting.find(id);
-                     if( await != _awaiting.end() )
+                     auto await = _awaiting->take( i->value().as_uint64() );
+                     if( await )
                      {
                         auto r = obj.find("result");
                         auto e = obj.find("error");
                         if( r != obj.end() )
                         {
-                           await->second->set_value( r->value() ); 
+                           await->set_value( r->value() ); 
                         }
                         else if( e != obj.end() )
                         {
@@ -160,21 +1011,21 @@ namespace fc { namespace rpc {
                              auto data = err.find( "data" );
                              if( data != err.end() )
                              {
-                                wlog(  "exception: ${except}", ("except", data->value() ) );
-                                await->second->set_exception( data->value().as<exception>().dynamic_copy_exception() );  
+                                await->set_exception( data->value().as<exception>().dynamic_copy_exception() );  
                              }
                              else
-                                await->second->set_exception( exception_ptr(new FC_EXCEPTION( exception, "${error}", ("error",e->value()) ) ) );
+                                await->set_exception( exception_ptr(new FC_EXCEPTION( exception, "${error}", ("error",e->value()) ) ) );
                           } 
                           catch ( fc::exception& e )
                           {
-                            elog( "Error parsing exception: ${e}", ("e", e.to_detail_string() ) );
-                            await->second->set_exception( e.dynamic_copy_exception() );
+                            fc_wlog( _logger, "error parsing exception: ${e}", ("e", e.to_detail_string() ) );
+                            await->set_exception( e.dynamic_copy_exception() );
                           }
                         }
                         else // id found without error, result, nor method field
                         {
                            fc_wlog( _logger, "no error or result specified in '${message}'", ("message",obj) );
+                           await->set_exception( exception_ptr(new FC_EXCEPTION( exception, "no error or result in reply" ) ) );
                         }
                      }
                   }
@@ -186,56 +1037,336 @@ namespace fc { namespace rpc {
                catch ( fc::exception& e ) // catch all other errors...
                {
                   fc_elog( _logger, "json rpc exception: ${exception}", ("exception",e ));
-                  elog( "json rpc exception: ${exception}", ("exception",e ));
                   close(e.dynamic_copy_exception());   
                }
             }
 
+            /** runs the call now, or queues it if its method is at its concurrency limit */
+            void dispatch( const pending_call& c )
+            {
+               ++_in_flight;
+               if( c.method != no_method )
+               {
+                  auto& m = _method_table[c.method];
+                  if( m.max_concurrency && m.running >= m.max_concurrency )
+                  {
+                     m.waiting.push_back( c );
+                     return;
+                  }
+               }
+               start( c );
+            }
+
+            /**
+             *  Every call in a batch is dispatched separately so that they run
+             *  concurrently, replies to our own calls are handled immediately.
+             */
+            void dispatch_batch( const variants& msgs,
+                                 const json_connection::message_handler& reply_to = json_connection::message_handler() )
+            {
+               auto batch = std::make_shared<batch_reply>();
+               batch->replies.resize( msgs.size() );
+               batch->reply_to = reply_to;
+               for( size_t i = 0; i < msgs.size(); ++i )
+               {
+                  if( !msgs[i].is_object() )
+                  {
+                     batch->replies[i] = mutable_variant_object( "id", variant() )
+                                         ( "error", mutable_variant_object( "message", "Invalid Request" )( "code", -32600 ) );
+                     continue;
+                  }
+                  const variant_object& obj = msgs[i].get_object();
+                  auto m = obj.find("method");
+                  if( m != obj.end() )
+                  {
+                     ++batch->pending;
+                     dispatch( pending_call( obj, resolve( m->value() ), request_deadline( obj ), batch, i ) );
+                  }
+                  else
+                     handle_reply( obj );
+               }
+               if( !batch->pending ) send_batch( *batch );
+            }
+
+            void start( const pending_call& c )
+            {
+               if( c.method != no_method ) ++_method_table[c.method].running;
+               fc::thread* t = nullptr;
+               if( _config.handler_threads.size() && (c.method == no_method || !_method_table[c.method].local) )
+                  t = _config.handler_threads[ _next_handler_thread++ % _config.handler_threads.size() ];
+
+               fc::async( [=]()
+               {
+                  bool replied = false;
+                  try
+                  {
+                     variant     reply;
+                     call_timing timing;
+                     if( t && t != &fc::thread::current() )
+                        reply = t->async( [=,&timing](){ return call_reply( c, timing ); }, "json_connection::call" ).wait();
+                     else
+                        reply = call_reply( c, timing );
+                     record_call( c, timing );
+
+                     // only the method runs on the handler thread, the reply is sent from this one
+                     if( c.batch )
+                        c.batch->replies[c.index] = fc::move(reply);
+                     else if( !reply.is_null() || c.reply_to )
+                     {
+                        replied = true;
+                        auto serialized = send_reply( c.reply_to, reply );
+                        if( !c.reply_to && c.method != no_method )
+                           _method_table[c.method].stats.serialized.record( serialized );
+                     }
+                  }
+                  catch ( const fc::exception& e )
+                  {
+                     fc_elog( _logger, "json rpc exception: ${exception}", ("exception",e) );
+                  }
+                  catch ( const std::exception& e )
+                  {
+                     fc_elog( _logger, "json rpc exception: ${exception}", ("exception",e.what()) );
+                  }
+                  // whoever called handle_message() waits for a reply to every message
+                  if( c.reply_to && !c.batch && !replied )
+                     c.reply_to( internal_error( c.msg ) );
+                  finish( c );
+               }, "json_connection::dispatch" );
+            }
+
+            void record_call( const pending_call& c, const call_timing& timing )
+            {
+               if( c.method == no_method )
+               {
+                  ++_unknown_calls;
+                  return;
+               }
+               auto& s = _method_table[c.method].stats;
+               ++s.calls;
+               if( timing.failed ) ++s.errors;
+               s.queued.record( timing.started - c.received );
+               s.handled.record( timing.finished - timing.started );
+            }
+
+            /** the counters and gauges of the connection and of each method that has been called */
+            variant_object stats()
+            {
+               mutable_variant_object methods;
+               for( auto itr = _method_ids.begin(); itr != _method_ids.end(); ++itr )
+               {
+                  const method_entry& m = _method_table[itr->second];
+                  if( !m.stats.calls && !m.running && m.waiting.empty() ) continue;
+                  methods( itr->first, mutable_variant_object( "calls", m.stats.calls )
+                                                             ( "errors", m.stats.errors )
+                                                             ( "running", m.running )
+                                                             ( "waiting", uint64_t(m.waiting.size()) )
+                                                             ( "queued", m.stats.queued.snapshot() )
+                                                             ( "handled", m.stats.handled.snapshot() )
+                                                             ( "serialized", m.stats.serialized.snapshot() ) );
+               }
+
+               mutable_variant_object result( "messages_in", _messages_in );
+               result( "bytes_in", _in ? _in->bytes_read() : uint64_t(0) )
+                     ( "unknown_calls", _unknown_calls )
+                     ( "in_flight", _in_flight )
+                     ( "awaiting_replies", _awaiting->size() );
+               {
+                  fc::scoped_lock<fc::mutex> lock(_write_mutex);
+                  result( "messages_out", _messages_out )
+                        ( "bytes_out", _bytes_out )
+                        ( "unsent_bytes", uint64_t(_outbox.size()) )
+                        ( "serialized", _serialized.snapshot() );
+               }
+               result( "methods", fc::move(methods) );
+               return result;
+            }
+
+            void finish( const pending_call& c )
+            {
+               if( c.batch && --c.batch->pending == 0 )
+               {
+                  try
+                  {
+                     send_batch( *c.batch );
+                  }
+                  catch ( const fc::exception& e )
+                  {
+                     fc_wlog( _logger, "unable to send batch reply: ${exception}", ("exception",e) );
+                  }
+               }
+               if( c.method != no_method )
+               {
+                  auto& m = _method_table[c.method];
+                  --m.running;
+                  if( m.waiting.size() && (!m.max_concurrency || m.running < m.max_concurrency) )
+                  {
+                     auto next = fc::move( m.waiting.front() );
+                     m.waiting.pop_front();
+                     start( next );
+                  }
+               }
+               --_in_flight;
+               if( _slot_free && !_slot_free->ready() )
+                  _slot_free->set_value();
+               task_done();
+            }
+
+            /** wakes the destructor once no task refers to this, must be the last use of this by a task */
+            void task_done()
+            {
+               if( _idle && !_in_flight && !_delivering && !_idle->ready() )
+                  _idle->set_value();
+            }
+
+            /** waits for the calls in flight and the deliver() tasks, which refer to this */
+            void wait_for_tasks()
+            {
+               while( _in_flight || _delivering )
+               {
+                  _idle.reset( new fc::promise<void>( "json_connection::idle" ) );
+                  auto idle = _idle;
+                  idle->wait();
+               }
+            }
+
+            /** reads the next message in either format */
+            variant read_message()
+            {
+               char c = _in->peek();
+               while( c == ' ' || c == '\n' || c == '\r' || c == '\t' )
+               {
+                  _in->get();
+                  c = _in->peek();
+               }
+               if( c != binary_message_marker )
+                  return json::from_stream(*_in);
+
+               _in->get();
+               uint32_t size = 0;
+               fc::raw::unpack( *_in, size );
+               if( size > _config.max_message_size )
+                  FC_THROW_EXCEPTION( exception, "message of ${size} bytes exceeds the limit of ${max}",
+                                      ("size",size)("max",_config.max_message_size) );
+               std::vector<char> buf( size );
+               if( size ) _in->read( buf.data(), size );
+
+               if( !_binary && _config.accept_binary )
+               {
+                  // reply in the format the remote side has shown it understands
+                  fc::scoped_lock<fc::mutex> lock(_write_mutex);
+                  _binary = true;
+               }
+
+               variant v;
+               fc::datastream<const char*> ds( buf.data(), buf.size() );
+               fc::raw::unpack( ds, v );
+               return v;
+            }
+
+            /** waits until fewer than max_in_flight requests are being handled */
+            void wait_for_slot()
+            {
+               while( _config.max_in_flight && _in_flight >= _config.max_in_flight )
+               {
+                  // handle_message() may be waiting too, they share the promise
+                  if( !_slot_free || _slot_free->ready() )
+                     _slot_free.reset( new fc::promise<void>( "json_connection::slot_free" ) );
+                  auto slot_free = _slot_free;
+                  slot_free->wait();
+               }
+            }
+
+            /** handles a message that did not arrive on _in, every reply goes to reply_to */
+            void handle_message( const variant& v, const json_connection::message_handler& reply_to )
+            {
+               wait_for_slot();
+               ++_messages_in;
+               fc_dlog( _logger, "recv: ${message}", ("message",v) );
+               if( v.is_array() )
+               {
+                  dispatch_batch( v.get_array(), reply_to );
+                  return;
+               }
+               if( !v.is_object() )
+               {
+                  reply_to( mutable_variant_object( "id", variant() )
+                            ( "error", mutable_variant_object( "message", "Invalid Request" )( "code", -32600 ) ) );
+                  return;
+               }
+               const variant_object& obj = v.get_object();
+               auto m = obj.find("method");
+               if( m != obj.end() )
+               {
+                  pending_call c( obj, resolve( m->value() ), request_deadline( obj ) );
+                  c.reply_to = reply_to;
+                  dispatch( c );
+               }
+               else
+               {
+                  handle_reply( obj );
+                  reply_to( variant() );
+               }
+            }
+
             void read_loop()
             {
                try 
                {
-                  fc::string line;
                   while( true )
                   {
-                      variant v = json::from_stream(*_in);
-                      ///ilog( "input: ${in}", ("in", v ) );
-                      wlog(  "recv: ${line}", ("line", line) );
-                      fc::async([=](){ handle_message(v.get_object()); });
+                      wait_for_slot();
+
+                      variant v = read_message();
+                      ++_messages_in;
+                      fc_dlog( _logger, "recv: ${message}", ("message",v) );
+                      if( v.is_array() )
+                      {
+                         dispatch_batch( v.get_array() );
+                         continue;
+                      }
+                      if( !v.is_object() )
+                      {
+                         fc_wlog( _logger, "invalid message '${message}'", ("message",v) );
+                         continue;
+                      }
+                      const variant_object& obj = v.get_object();
+                      auto m = obj.find("method");
+                      if( m != obj.end() )
+                         dispatch( pending_call( obj, resolve( m->value() ), request_deadline( obj ) ) );
+                      else // replies only complete a promise, there is no need for a task
+                         handle_reply( obj );
                   } 
                } 
                catch ( eof_exception& eof ) 
                { 
                   _eof = true; 
-               wlog( "close" );
                   close( eof.dynamic_copy_exception() );
                }
                catch ( exception& e )
                {
-               wlog( "close" );
                   close( e.dynamic_copy_exception() );
                }
                catch ( ... )
                {
-               wlog( "close" );
                   close( fc::exception_ptr(new FC_EXCEPTION( unhandled_exception, "json connection read error" )) );
                }
-               wlog( "close" );
             }
 
             void close( fc::exception_ptr e )
             {
-               wlog( "close ${reason}", ("reason", e->to_detail_string() ) );
-               for( auto itr = _awaiting.begin(); itr != _awaiting.end(); ++itr )
+               fc_dlog( _logger, "close: ${reason}", ("reason", e->to_detail_string() ) );
+               // both the reader and the writer close on error, only fail each call once
+               auto awaiting = _awaiting->close( e );
+               for( auto itr = awaiting.begin(); itr != awaiting.end(); ++itr )
                {
-                  itr->second->set_exception( e->dynamic_copy_exception() );
+                  (*itr)->set_exception( e->dynamic_copy_exception() );
                }
             }
       };
    }//namespace detail
 
-   json_connection::json_connection( fc::buffered_istream_ptr in, fc::buffered_ostream_ptr out )
-   :my( new detail::json_connection_impl(fc::move(in),fc::move(out)) )
+   json_connection::json_connection( fc::buffered_istream_ptr in, fc::buffered_ostream_ptr out, const config& c )
+   :my( new detail::json_connection_impl(fc::move(in),fc::move(out),c) )
    {}
 
    json_connection::~json_connection()
@@ -255,6 +1386,27 @@ namespace fc { namespace rpc {
          // unhandled, unexpected exception cannot throw from destructor, so log it.
          wlog( "${exception}", ("exception",e.to_detail_string()) );
       }
+
+      // calls in flight and event deliveries refer to my and may still send
+      try
+      {
+         my->wait_for_tasks();
+      }
+      catch ( fc::exception& e )
+      {
+         wlog( "${exception}", ("exception",e.to_detail_string()) );
+      }
+
+      // the writer refers to my, let it send what is queued
+      try
+      {
+         if( my->_writer.valid() && !my->_writer.ready() )
+            my->_writer.wait();
+      }
+      catch ( fc::exception& e )
+      {
+         wlog( "${exception}", ("exception",e.to_detail_string()) );
+      }
    }
 
    fc::future<void> json_connection::exec()
@@ -264,151 +1416,66 @@ namespace fc { namespace rpc {
          FC_THROW_EXCEPTION( assert_exception, "start should only be called once" );
       }
 
-      wlog(  "EXEC!!!\n" );
       return my->_done = fc::async( [=](){ my->read_loop(); } );
    }
 
-   void json_connection::add_method( const fc::string& name, method m )
+   void json_connection::add_method( const fc::string& name, method m, uint32_t max_concurrency )
    {
-      my->_methods.emplace(std::pair<std::string,method>(name,fc::move(m)));
+      auto& e = my->_method_table[ my->intern(name) ];
+      e.positional      = fc::move(m);
+      e.max_concurrency = max_concurrency;
    }
-   void json_connection::add_method( const fc::string& name, named_param_method m )
+   void json_connection::add_method( const fc::string& name, named_param_method m, uint32_t max_concurrency )
    {
-      my->_named_param_methods.emplace(std::pair<std::string,named_param_method>(name,fc::move(m)));
+      auto& e = my->_method_table[ my->intern(name) ];
+      e.named           = fc::move(m);
+      e.max_concurrency = max_concurrency;
+   }
+   void json_connection::add_generic_method( const fc::string& name, generic_method m, uint32_t max_concurrency )
+   {
+      auto& e = my->_method_table[ my->intern(name) ];
+      e.generic         = fc::move(m);
+      e.max_concurrency = max_concurrency;
    }
    void json_connection::remove_method( const fc::string& name )
    {
-      my->_methods.erase(name);
-      my->_named_param_methods.erase(name);
+      auto itr = my->_method_ids.find( name );
+      if( itr == my->_method_ids.end() ) return;
+      auto& e = my->_method_table[itr->second];
+      e.positional = method();
+      e.named      = named_param_method();
+      e.generic    = generic_method();
    }
    void json_connection::notice( const fc::string& method, const variants& args )
    {
-      fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
-      *my->_out << "{\"method\":";
-      json::to_stream( *my->_out, method );
-      if( args.size() )
-      {
-         *my->_out << ",\"params\":";
-         fc::json::to_stream( *my->_out, args );
-         *my->_out << "}\n";
-      }
-      else
-      {
-         *my->_out << ",\"params\":[]}\n";
-      }
+      my->send_message( mutable_variant_object( "method", method )( "params", args ) );
    }
    void json_connection::notice( const fc::string& method, const variant_object& named_args )
    {
-      {
-        fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
-        *my->_out << "{\"method\":";
-        json::to_stream( *my->_out, method );
-        *my->_out << ",\"params\":";
-        fc::json::to_stream( *my->_out, named_args );
-        *my->_out << "}\n";
-      }
-      my->_out->flush();
+      my->send_message( mutable_variant_object( "method", method )( "params", named_args ) );
    }
    void json_connection::notice( const fc::string& method )
    {
-      {
-        fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
-        *my->_out << "{\"method\":";
-        json::to_stream( *my->_out, method );
-        *my->_out << "}\n";
-      }
-      my->_out->flush();
+      my->send_message( mutable_variant_object( "method", method ) );
    }
 
 
    future<variant> json_connection::async_call( const fc::string& method, const variants& args )
    {
-      auto id = my->_next_id++;
-      my->_awaiting[id] = fc::promise<variant>::ptr( new fc::promise<variant>() );
-
-      {
-         fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
-         *my->_out << "{\"id\":";
-         *my->_out << id;
-         *my->_out << ",\"method\":";
-         json::to_stream( *my->_out, method );
-         if( args.size() )
-         {
-            *my->_out << ",\"params\":";
-            fc::json::to_stream( *my->_out, args );
-            *my->_out << "}\n";
-         }
-         else
-         {
-            *my->_out << ",\"params\":[]}\n";
-         }
-      }
-      my->_out->flush();
-      return my->_awaiting[id];
+      return my->call( method, args );
    }
 
    future<variant> json_connection::async_call( const fc::string& method, const variant& a1 )
    {
-      ilog( "");
-      auto id = my->_next_id++;
-      my->_awaiting[id] = fc::promise<variant>::ptr( new fc::promise<variant>() );
-
-      {
-         fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
-         *my->_out << "{\"id\":";
-         *my->_out << id;
-         *my->_out << ",\"method\":";
-         json::to_stream( *my->_out, method );
-         *my->_out << ",\"params\":[";
-         fc::json::to_stream( *my->_out, a1 );
-         *my->_out << "]}\n";
-      }
-      my->_out->flush();
-      return my->_awaiting[id];
+      return my->call( method, variants{ a1 } );
    }
    future<variant> json_connection::async_call( const fc::string& method, const variant& a1, const variant& a2 )
    {
-      ilog( "");
-      auto id = my->_next_id++;
-      my->_awaiting[id] = fc::promise<variant>::ptr( new fc::promise<variant>() );
-
-      {
-         fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
-         *my->_out << "{\"id\":";
-         *my->_out << id;
-         *my->_out << ",\"method\":";
-         json::to_stream( *my->_out, method );
-         *my->_out << ",\"params\":[";
-         fc::json::to_stream( *my->_out, a1 );
-         *my->_out << ",";
-         fc::json::to_stream( *my->_out, a2 );
-         *my->_out << "]}\n";
-      }
-      my->_out->flush();
-      return my->_awaiting[id];
+      return my->call( method, variants{ a1, a2 } );
    }
    future<variant> json_connection::async_call( const fc::string& method, const variant& a1, const variant& a2, const variant& a3 )
    {
-      ilog( "");
-      auto id = my->_next_id++;
-      my->_awaiting[id] = fc::promise<variant>::ptr( new fc::promise<variant>() );
-
-      {
-         fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
-         *my->_out << "{\"id\":";
-         *my->_out << id;
-         *my->_out << ",\"method\":";
-         json::to_stream( *my->_out, method );
-         *my->_out << ",\"params\":[";
-         fc::json::to_stream( *my->_out, a1 );
-         *my->_out << ",";
-         fc::json::to_stream( *my->_out, a2 );
-         *my->_out << ",";
-         fc::json::to_stream( *my->_out, a3 );
-         *my->_out << "]}\n";
-      }
-      my->_out->flush();
-      return my->_awaiting[id];
+      return my->call( method, variants{ a1, a2, a3 } );
    }
 
 
@@ -419,36 +1486,125 @@ namespace fc { namespace rpc {
    }
    future<variant> json_connection::async_call( const fc::string& method, const variant_object& named_args )
    {
-      wlog( "${method}  ${args}", ("method",method)("args",named_args) );
-      auto id = my->_next_id++;
-      my->_awaiting[id] = fc::promise<variant>::ptr( new fc::promise<variant>() );
-      fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
+      return my->call( method, named_args );
+   }
+   future<variant> json_connection::async_call( const fc::string& method )
+   {
+      return my->call( method, variant() );
+   }
+
+   future<variant> json_connection::async_generic_call( const fc::string& method, variant params, reply_handler on_reply,
+                                                        const fc::time_point& deadline )
+   {
+      return my->call( method, fc::move(params), on_reply, deadline );
+   }
+
+   std::vector<future<variant>> json_connection::async_batch( const std::vector<batch_call>& calls, const fc::time_point& deadline )
+   {
+      std::vector<future<variant>> results;
+      if( calls.empty() ) return results;
+
+      auto now = fc::time_point::now();
+      auto d   = my->call_deadline( deadline, now );
+      if( d <= now )
+      {
+         for( size_t i = 0; i < calls.size(); ++i )
+         {
+            auto p = fc::promise<variant>::ptr( new fc::promise<variant>() );
+            p->set_exception( exception_ptr( new timeout_exception(
+                              FC_LOG_MESSAGE( warn, "the deadline of the batch passed before it was sent" ) ) ) );
+            results.push_back( p );
+         }
+         return results;
+      }
+
+      std::vector<uint64_t> ids;
+      ids.reserve( calls.size() );
+      results.reserve( calls.size() );
+
+      variants msgs;
+      msgs.reserve( calls.size() );
+      for( size_t i = 0; i < calls.size(); ++i )
+      {
+         auto p = fc::promise<variant>::ptr( new fc::promise<variant>() );
+         ids.push_back( my->_awaiting->add( p, d ) );
+         results.push_back( p );
+
+         mutable_variant_object msg( "id", ids.back() );
+         msg( "method", calls[i].method );
+         if( !calls[i].params.is_null() ) msg( "params", calls[i].params );
+         my->add_timeout( msg, d, now );
+         msgs.push_back( fc::move(msg) );
+      }
+
+      try
+      {
+         my->send_message( fc::move(msgs) );
+      }
+      catch ( ... )
       {
-         *my->_out << "{\"id\":";
-         *my->_out << id;
-         *my->_out << ",\"method\":";
-         json::to_stream( *my->_out, method );
-         *my->_out << ",\"params\":";
-         fc::json::to_stream( *my->_out, named_args );
-         *my->_out << "}\n";
+         for( auto itr = ids.begin(); itr != ids.end(); ++itr )
+            my->_awaiting->take( *itr );
+         throw;
       }
-      my->_out->flush();
-      return my->_awaiting[id];
+      return results;
    }
-   future<variant> json_connection::async_call( const fc::string& method )
+
+   void json_connection::handle_message( const variant& msg, const message_handler& on_reply )
    {
-      auto id = my->_next_id++;
-      my->_awaiting[id] = fc::promise<variant>::ptr( new fc::promise<variant>() );
-      fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
+      FC_ASSERT( on_reply );
+      my->handle_message( msg, on_reply );
+   }
+
+   void json_connection::add_topic( const fc::string& topic, const topic_config& c )
+   {
+      FC_ASSERT( c.max_queue > 0 );
+      my->_topics[topic].config = c;
+   }
+
+   void json_connection::publish( const fc::string& topic, const variant& msg )
+   {
+      my->publish( topic, msg );
+   }
+
+   future<uint64_t> json_connection::subscribe( const fc::string& topic, const event_handler& on_event, uint32_t window )
+   {
+      FC_ASSERT( window > 0 );
+      uint64_t id = my->_next_subscription++;
+      auto& s = my->_subscriptions[id];
+      s.on_event = on_event;
+      s.window   = window;
+
+      // registered first, events may arrive before the reply
+      fc::promise<uint64_t>::ptr prom( new fc::promise<uint64_t>( "json_connection::subscribe" ) );
+      auto impl = my.get();
+      try
+      {
+         my->call( "rpc.subscribe", mutable_variant_object( "topic", topic )( "subscription", id )( "credit", window ),
+                   [=]( const variant&, const fc::exception_ptr& e )
+                   {
+                      if( !e )
+                      {
+                         prom->set_value( id );
+                         return;
+                      }
+                      impl->_subscriptions.erase( id );
+                      prom->set_exception( e );
+                   } );
+      }
+      catch ( ... )
       {
-        *my->_out << "{\"id\":";
-        *my->_out << id;
-        *my->_out << ",\"method\":";
-         json::to_stream( *my->_out, method );
-        *my->_out << "}\n";
+         my->_subscriptions.erase( id );
+         throw;
       }
-      my->_out->flush();
-      return my->_awaiting[id];
+      return prom;
+   }
+
+   void json_connection::unsubscribe( uint64_t subscription )
+   {
+      if( !my->_subscriptions.erase( subscription ) ) return;
+      my->send_message( mutable_variant_object( "method", "rpc.unsubscribe" )
+                        ( "params", mutable_variant_object( "subscription", subscription ) ) );
    }
 
    logger json_connection::get_logger()const
@@ -456,6 +1612,17 @@ namespace fc { namespace rpc {
       return my->_logger;
    }
 
+   json_connection::wire_format json_connection::get_format()const
+   {
+      fc::scoped_lock<fc::mutex> lock(my->_write_mutex);
+      return my->_binary ? binary_format : json_format;
+   }
+
+   variant_object json_connection::get_stats()const
+   {
+      return my->stats();
+   }
+
    void   json_connection::set_logger( const logger& l )
    {
       my->_logger = l;
@@ -0,0 +1,408 @@
+#include <fc/rpc/server.hpp>
+#include <fc/network/tcp_socket.hpp>
+#include <fc/network/http/server.hpp>
+#include <fc/io/json.hpp>
+#include <fc/thread/thread.hpp>
+#include <fc/thread/scoped_lock.hpp>
+#include <fc/thread/spin_lock.hpp>
+#include <fc/exception/exception.hpp>
+#include <fc/log/logger.hpp>
+#include <map>
+
+namespace fc { namespace rpc {
+
+  namespace detail {
+    struct tcp_connection
+    {
+       /** the thread that accepted the socket, which is the only one to use it */
+       fc::thread*         thread;
+       tcp_socket_ptr      sock;
+       json_connection_ptr con;
+    };
+  }
+
+  /**
+   *  Tasks refer to the impl directly, close() waits for every one of them
+   *  before the impl can be destroyed.
+   */
+  class server::impl
+  {
+    public:
+      impl( const server::config& c )
+      :_config(c),_registry_version(0),_next_connection(0),_active(0),_closed(false),_next_http_thread(0)
+      {
+         for( uint32_t i = 0; i < c.threads; ++i )
+         {
+            _own_threads.push_back( std::unique_ptr<fc::thread>( new fc::thread( "rpc::server" ) ) );
+            _threads.push_back( _own_threads.back().get() );
+         }
+         if( _threads.empty() ) _threads.push_back( &fc::thread::current() );
+         _http_connections.resize( _threads.size() );
+         _http_versions.resize( _threads.size() );
+      }
+
+      ~impl()
+      {
+         for( auto itr = _own_threads.begin(); itr != _own_threads.end(); ++itr )
+            (*itr)->quit();
+      }
+
+      void add_handler( const server::connection_handler& h )
+      {
+         fc::scoped_lock<fc::spin_lock> lock(_lock);
+         _handlers.push_back( h );
+         ++_registry_version;
+      }
+      void add_topic( const fc::string& topic, const json_connection::topic_config& c )
+      {
+         fc::scoped_lock<fc::spin_lock> lock(_lock);
+         _topics.push_back( [=]( json_connection& con ){ con.add_topic( topic, c ); } );
+      }
+
+      /**
+       *  adds the registered methods to c, and the topics if it can push to its client,
+       *  returns the _registry_version they were taken from
+       */
+      uint64_t setup( json_connection& c, bool with_topics )
+      {
+         std::vector<server::connection_handler> handlers;
+         uint64_t version;
+         {
+            fc::scoped_lock<fc::spin_lock> lock(_lock);
+            handlers = _handlers;
+            version  = _registry_version;
+            if( with_topics ) handlers.insert( handlers.end(), _topics.begin(), _topics.end() );
+         }
+         for( auto itr = handlers.begin(); itr != handlers.end(); ++itr )
+            (*itr)( c );
+         return version;
+      }
+
+      uint64_t registry_version()
+      {
+         fc::scoped_lock<fc::spin_lock> lock(_lock);
+         return _registry_version;
+      }
+
+      /** publishes on each connection's own thread, without waiting for any of them */
+      void publish( const fc::string& topic, const variant& msg )
+      {
+         std::vector<detail::tcp_connection> connections;
+         {
+            fc::scoped_lock<fc::spin_lock> lock(_lock);
+            for( auto itr = _connections.begin(); itr != _connections.end(); ++itr )
+               if( itr->second.con ) connections.push_back( itr->second );
+         }
+         for( auto itr = connections.begin(); itr != connections.end(); ++itr )
+         {
+            auto con = itr->con;
+            itr->thread->async( [=]()
+            {
+               try
+               {
+                  con->publish( topic, msg );
+               }
+               catch ( const fc::exception& e )
+               {
+                  wlog( "unable to publish to ${topic}: ${e}", ("topic",topic)("e", e.to_detail_string()) );
+               }
+            }, "rpc::server::publish" );
+         }
+      }
+
+      /** counts a task that close() must wait for, false once closed */
+      bool begin_task()
+      {
+         fc::scoped_lock<fc::spin_lock> lock(_lock);
+         if( _closed ) return false;
+         ++_active;
+         return true;
+      }
+      void end_task()
+      {
+         fc::promise<void>::ptr drained;
+         {
+            fc::scoped_lock<fc::spin_lock> lock(_lock);
+            if( --_active == 0 ) drained = _drained;
+         }
+         if( drained ) drained->set_value();
+      }
+
+      /**
+       *  counts a connection as a task and records it, in one step so that close() either
+       *  sees its socket or refuses it, false once closed
+       */
+      bool begin_connection( const tcp_socket_ptr& s, uint64_t& id )
+      {
+         fc::scoped_lock<fc::spin_lock> lock(_lock);
+         if( _closed ) return false;
+         ++_active;
+         id = _next_connection++;
+         detail::tcp_connection& c = _connections[id];
+         c.thread = &fc::thread::current();
+         c.sock   = s;
+         return true;
+      }
+
+      /** runs a json_connection on the thread that accepted s until either side closes it */
+      void serve( const tcp_socket_ptr& s )
+      {
+         uint64_t id;
+         if( !begin_connection( s, id ) )
+         {
+            s->close();
+            return;
+         }
+
+         try
+         {
+            auto con = std::make_shared<json_connection>( std::make_shared<fc::buffered_istream>( s ),
+                                                          std::make_shared<fc::buffered_ostream>( s ),
+                                                          _config.connection );
+            setup( *con, true );
+            {
+               fc::scoped_lock<fc::spin_lock> lock(_lock);
+               _connections[id].con = con;
+            }
+            con->exec().wait();
+            {
+               fc::scoped_lock<fc::spin_lock> lock(_lock);
+               _connections[id].con.reset();
+            }
+         }
+         catch ( const fc::exception& e )
+         {
+            wlog( "rpc connection closed: ${e}", ("e", e.to_detail_string()) );
+         }
+         try
+         {
+            s->close();
+         }
+         catch ( const fc::exception& ) {}
+
+         {
+            fc::scoped_lock<fc::spin_lock> lock(_lock);
+            _connections.erase( id );
+         }
+         end_task();
+      }
+
+      void handle_http( const http::request& req, const http::server::response& rep )
+      {
+         if( req.method != "POST" )
+         {
+            rep.set_status( http::reply::MethodNotAllowed );
+            rep.add_header( "Allow", "POST" );
+            return;
+         }
+         if( !begin_task() )
+         {
+            rep.set_status( http::reply::InternalServerError );
+            return;
+         }
+
+         try
+         {
+            variant msg;
+            try
+            {
+               msg = fc::json::from_string( fc::string( req.body.begin(), req.body.end() ) );
+            }
+            catch ( const fc::exception& )
+            {
+               send_http_reply( rep, mutable_variant_object( "id", variant() )
+                                     ( "error", mutable_variant_object( "message", "Parse error" )( "code", -32700 ) ) );
+               end_task();
+               return;
+            }
+
+            // only the thread listening for HTTP gets here
+            size_t i = _next_http_thread++ % _threads.size();
+            fc::promise<variant>::ptr reply( new fc::promise<variant>( "rpc::server::http_reply" ) );
+            _threads[i]->async( [=]()
+            {
+               try
+               {
+                  // each thread has its own connection for HTTP requests, dispatch state is per thread,
+                  // it is replaced once methods have been added since it was set up
+                  auto& con = _http_connections[i];
+                  if( !con || _http_versions[i] != registry_version() )
+                  {
+                     auto fresh = std::make_shared<json_connection>( fc::buffered_istream_ptr(), fc::buffered_ostream_ptr(),
+                                                                     _config.connection );
+                     _http_versions[i] = setup( *fresh, false );
+                     // the old one waits for its calls in flight as it is destroyed
+                     con = fresh;
+                  }
+                  con->handle_message( msg, [=]( const variant& r ){ reply->set_value( r ); } );
+               }
+               catch ( const fc::exception& e )
+               {
+                  reply->set_exception( e.dynamic_copy_exception() );
+               }
+               catch ( const std::exception& e )
+               {
+                  reply->set_exception( std::make_shared<fc::std_exception>( FC_LOG_MESSAGE( error, "${what}", ("what",e.what()) ),
+                                                                             std::current_exception(), e.what() ) );
+               }
+            }, "rpc::server::http_request" );
+
+            send_http_reply( rep, reply->wait() );
+         }
+         catch ( const fc::exception& e )
+         {
+            wlog( "unable to handle rpc request: ${e}", ("e", e.to_detail_string()) );
+            rep.set_status( http::reply::InternalServerError );
+         }
+         end_task();
+      }
+
+      /** a notification gets an empty body */
+      static void send_http_reply( const http::server::response& rep, const variant& r )
+      {
+         if( r.is_null() )
+         {
+            rep.set_length( 0 );
+            return;
+         }
+         fc::string body = fc::json::to_string( r );
+         rep.add_header( "Content-Type", "application/json" );
+         rep.set_length( body.size() );
+         rep.write( body.c_str(), body.size() );
+      }
+
+      void listen_tcp( uint16_t port )
+      {
+         // replies are flushed as soon as they are written
+         fc::tcp_server::config c;
+         c.no_delay = true;
+
+         auto group = std::make_shared<fc::tcp_server_group>();
+         group->listen( port, _threads, [this]( const tcp_socket_ptr& s ){ serve( s ); }, c );
+         _tcp.push_back( group );
+      }
+
+      void listen_http( uint16_t port )
+      {
+         _threads.front()->async( [=]()
+         {
+            auto s = std::make_shared<http::server>( port );
+            s->on_request( [this]( const http::request& req, const http::server::response& rep ){ handle_http( req, rep ); } );
+            _http.push_back( s );
+         }, "rpc::server::listen_http" ).wait();
+      }
+
+      void close()
+      {
+         std::vector<detail::tcp_connection> connections;
+         fc::promise<void>::ptr              drained;
+         {
+            fc::scoped_lock<fc::spin_lock> lock(_lock);
+            if( _closed ) return;
+            _closed = true;
+            for( auto itr = _connections.begin(); itr != _connections.end(); ++itr )
+               connections.push_back( itr->second );
+            if( _active )
+               drained = _drained = fc::promise<void>::ptr( new fc::promise<void>( "rpc::server::close" ) );
+         }
+
+         _tcp.clear();
+         _threads.front()->async( [=](){ _http.clear(); }, "rpc::server::close" ).wait();
+
+         // a closed socket ends its connection's read loop
+         for( auto itr = connections.begin(); itr != connections.end(); ++itr )
+         {
+            auto s = itr->sock;
+            itr->thread->async( [=](){ s->close(); }, "rpc::server::close" ).wait();
+         }
+         if( drained ) drained->wait();
+
+         for( size_t i = 0; i < _threads.size(); ++i )
+            _threads[i]->async( [=](){ _http_connections[i].reset(); }, "rpc::server::close" ).wait();
+      }
+
+      server::config                                   _config;
+      std::vector<std::unique_ptr<fc::thread>>         _own_threads;
+      std::vector<fc::thread*>                         _threads;
+
+      /** guards _handlers, _registry_version, _topics, _connections, _active, _closed and _drained */
+      fc::spin_lock                                    _lock;
+      std::vector<server::connection_handler>          _handlers;
+      /** incremented as handlers are added */
+      uint64_t                                         _registry_version;
+      /** only added to TCP connections, HTTP clients can not be sent events */
+      std::vector<server::connection_handler>          _topics;
+      std::map<uint64_t,detail::tcp_connection>        _connections;
+      uint64_t                                         _next_connection;
+      /** connections and HTTP requests being handled */
+      uint32_t                                         _active;
+      bool                                             _closed;
+      /** set by close() while _active is not 0 */
+      fc::promise<void>::ptr                           _drained;
+
+      std::vector<std::shared_ptr<fc::tcp_server_group>> _tcp;
+      /** only used on the first thread */
+      std::vector<std::shared_ptr<http::server>>       _http;
+      size_t                                           _next_http_thread;
+      /** used for HTTP requests, each only on its own thread */
+      std::vector<json_connection_ptr>                 _http_connections;
+      /** the _registry_version each of _http_connections was set up with */
+      std::vector<uint64_t>                            _http_versions;
+  };
+
+  server::server( const config& c )
+  :my( new impl( c ) ){}
+
+  server::~server()
+  {
+     try
+     {
+        close();
+     }
+     catch ( const fc::exception& e )
+     {
+        wlog( "${e}", ("e", e.to_detail_string()) );
+     }
+  }
+
+  void server::add_method( const fc::string& name, json_connection::method m, uint32_t max_concurrency )
+  {
+     my->add_handler( [=]( json_connection& c ){ c.add_method( name, m, max_concurrency ); } );
+  }
+  void server::add_method( const fc::string& name, json_connection::named_param_method m, uint32_t max_concurrency )
+  {
+     my->add_handler( [=]( json_connection& c ){ c.add_method( name, m, max_concurrency ); } );
+  }
+  void server::add_generic_method( const fc::string& name, json_connection::generic_method m, uint32_t max_concurrency )
+  {
+     my->add_handler( [=]( json_connection& c ){ c.add_generic_method( name, m, max_concurrency ); } );
+  }
+  void server::on_connection( const connection_handler& h )
+  {
+     my->add_handler( h );
+  }
+
+  void server::add_topic( const fc::string& topic, const json_connection::topic_config& c )
+  {
+     my->add_topic( topic, c );
+  }
+  void server::publish( const fc::string& topic, const variant& msg )
+  {
+     my->publish( topic, msg );
+  }
+
+  void server::listen_tcp( uint16_t port )
+  {
+     my->listen_tcp( port );
+  }
+  void server::listen_http( uint16_t port )
+  {
+     my->listen_http( port );
+  }
+
+  void server::close()
+  {
+     my->close();
+  }
+
+} } // fc::rpc
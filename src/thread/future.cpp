@@ -83,6 +83,14 @@ namespace fc {
       _blocked_thread->notify(ptr(this,true));
   }
   promise_base::~promise_base() { }
+  void promise_base::_reset(){
+    synchronized(_spin_yield)
+    _ready          = false;
+    _blocked_thread = nullptr;
+    _exceptp.reset();
+    _canceled       = false;
+    _timeout        = time_point::maximum();
+  }
   void promise_base::_set_timeout(){
     if( _ready ) 
       return;
@@ -246,6 +246,7 @@ namespace fc {
    }
 
    void thread::poke() {
+     if( my->io ) my->wake_io();
      boost::unique_lock<boost::mutex> lock(my->task_ready_mutex);
      my->task_ready.notify_one();
    }
@@ -263,8 +264,12 @@ namespace fc {
       // to aquire the lock and therefore there should be no contention on this lock except
       // when *this thread is about to block on a wait condition.  
       if( this != &current() &&  !stale_head ) { 
-          boost::unique_lock<boost::mutex> lock(my->task_ready_mutex);
-          my->task_ready.notify_one();
+          if( my->io ) {
+            my->wake_io();
+          } else {
+            boost::unique_lock<boost::mutex> lock(my->task_ready_mutex);
+            my->task_ready.notify_one();
+          }
       }
    }
 
@@ -6,6 +6,7 @@
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread.hpp>
 #include <boost/atomic.hpp>
+#include <boost/asio.hpp>
 #include <vector>
 //#include <fc/logger.hpp>
 
@@ -26,7 +27,11 @@ namespace fc {
              pt_head(0),
              ready_head(0),
              ready_tail(0),
-             blocked(0)
+             blocked(0),
+             io_poll_countdown(0),
+             io_timer_armed(false),
+             io_timer_generation(0),
+             next_posted_num(1)
             { 
               static boost::atomic<int> cnt(0);
               name = fc::string("th_") + char('a'+cnt++); 
@@ -85,6 +90,25 @@ namespace fc {
 
            fc::context*             blocked;
 
+           /**
+            *  Set by fc::asio::integrate_reactor(), when present the idle loop
+            *  runs this io_service instead of waiting on task_ready so that
+            *  completions are handled without leaving the thread.
+            */
+           std::unique_ptr<boost::asio::io_service>        io;
+           std::unique_ptr<boost::asio::io_service::work>  io_work;
+           std::unique_ptr<boost::asio::deadline_timer>    io_timer;
+           uint32_t                                        io_poll_countdown;
+           /**
+            *  True while a wait on io_timer is outstanding for io_timer_deadline,
+            *  cleared by the handler of the latest wait only.
+            */
+           bool                                            io_timer_armed;
+           time_point                                      io_timer_deadline;
+           uint64_t                                        io_timer_generation;
+           /** orders tasks of the same priority first in, first out */
+           uint64_t                                        next_posted_num;
+
 
 
 #if 0
@@ -197,8 +221,17 @@ namespace fc {
 
            void enqueue( task_base* t ) {
                 time_point now = time_point::now();
-                task_base* cur = t;
+                // task_in_queue is a stack, reverse it so tasks are numbered in the order they were posted
+                task_base* posted = 0;
+                while( t ) {
+                  task_base* n = t->_next;
+                  t->_next = posted;
+                  posted = t;
+                  t = n;
+                }
+                task_base* cur = posted;
                 while( cur ) {
+                  cur->_posted_num = next_posted_num++;
                   if( cur->_when > now ) {
                     task_sch_queue.push_back(cur);
                     std::push_heap( task_sch_queue.begin(),
@@ -362,8 +395,41 @@ namespace fc {
               }
               free_list.clear();
            }
+           /** wakes the thread if it is idle in wait_for_io() */
+           void wake_io() {
+              io->post( [](){} );
+           }
+
+           /**
+            *  Runs completions until one is handled or timeout_time is reached,
+            *  other threads post to the io_service to wake us up.
+            *
+            *  Setting the timer cancels the wait already on it, and the cancelled
+            *  handler would end run_one() at once, so the timer is only set when
+            *  no wait is outstanding or timeout_time is earlier than its deadline.
+            */
+           void wait_for_io( const time_point& timeout_time ) {
+              if( timeout_time != time_point::maximum() &&
+                  ( !io_timer_armed || timeout_time < io_timer_deadline ) ) {
+                io_timer->expires_from_now( boost::posix_time::microseconds( 
+                                 (timeout_time - time_point::now()).count() ) );
+                io_timer_armed    = true;
+                io_timer_deadline = timeout_time;
+                uint64_t generation = ++io_timer_generation;
+                io_timer->async_wait( [this,generation]( const boost::system::error_code& ) {
+                   if( generation == io_timer_generation ) io_timer_armed = false;
+                });
+              }
+              io->run_one();
+           }
+
            void process_tasks() {
               while( !done || blocked ) {
+                // completions must not starve behind a long run of tasks
+                if( io && ++io_poll_countdown >= 64 ) {
+                  io_poll_countdown = 0;
+                  io->poll();
+                }
                 if( run_next_task() ) continue;
 
                 // if I have something else to do other than
@@ -376,6 +442,17 @@ namespace fc {
 
                 clear_free_list();
 
+                if( io ) {
+                  if( io->poll() ) continue;
+                  if( has_next_task() ) continue;
+                  time_point timeout_time = check_for_timeouts();
+
+                  if( done ) return;
+                  if( timeout_time != time_point::min() ) 
+                    wait_for_io( timeout_time );
+                  continue;
+                }
+
                 { // lock scope
                   boost::unique_lock<boost::mutex> lock(task_ready_mutex);
                   if( has_next_task() ) continue;